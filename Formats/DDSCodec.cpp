@@ -0,0 +1,998 @@
+// (c) by Stefan Roettger, licensed under GPL 2+
+// see https://code.google.com/p/vvv/
+
+#include "DDSCodec.h"
+
+#include <QThread>
+#include <QVector>
+#include <QtConcurrent>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "common.h"
+
+#define DDS_MAXSTR (256)
+
+#define DDS_BLOCKSIZE (1<<20)
+#define DDS_INTERLEAVE (1<<24)
+
+#define DDS_RL (7)
+
+#define DDS_MAXHEADER (4096)
+
+namespace {
+
+const char DDS_ID[]="DDS v3d\n";
+const char DDS_ID2[]="DDS v3e\n";
+
+const unsigned short int DDS_INTEL=1;
+
+inline bool DDS_ISINTEL()
+{return(*((const uint8_t *)(&DDS_INTEL)+1)==0);}
+
+// helper functions for DDS:
+
+inline unsigned int DDS_shiftl(const unsigned int value,const unsigned int bits)
+{return((bits>=32)?0:value<<bits);}
+
+inline unsigned int DDS_shiftr(const unsigned int value,const unsigned int bits)
+{return((bits>=32)?0:value>>bits);}
+
+inline void DDS_swapuint(unsigned int *x)
+{
+    unsigned int tmp=*x;
+    
+    *x=((tmp&0xff)<<24)|
+            ((tmp&0xff00)<<8)|
+            ((tmp&0xff0000)>>8)|
+            ((tmp&0xff000000)>>24);
+}
+
+inline int DDS_code(int bits)
+{return(bits>1?bits-1:bits);}
+
+inline int DDS_decode(int bits)
+{return(bits>=1?bits+1:bits);}
+
+// (de)interleave a single block of a byte stream, tmp has to hold bytes
+void DDS_deinterleaveblock(uint8_t *data,unsigned int bytes,unsigned int skip,uint8_t *tmp,bool restore)
+{
+    unsigned int i,j;
+    
+    uint8_t *ptr;
+    
+    if (!restore)
+        for (ptr=tmp,i=0; i<skip; i++)
+            for (j=i; j<bytes; j+=skip) *ptr++=data[j];
+    else
+        for (ptr=data,i=0; i<skip; i++)
+            for (j=i; j<bytes; j+=skip) tmp[j]=*ptr++;
+    
+    memcpy(data,tmp,bytes);
+}
+
+struct DDS_pvmheader
+{
+    unsigned int width,height,depth,components;
+    float scalex,scaley,scalez;
+    
+    unsigned int offset; // where the voxels start
+};
+
+// parse the header of the PVM volume starting at data,
+// returns its version, 0 if there is none and -1 if it is malformed
+int DDS_parsepvm(const uint8_t *data,unsigned int bytes,DDS_pvmheader *header)
+{
+    char str[DDS_MAXHEADER];
+    const char *ptr;
+    
+    int version=1;
+    
+    if (bytes>=DDS_MAXHEADER) bytes=DDS_MAXHEADER-1;
+    
+    memcpy(str,data,bytes);
+    str[bytes]='\0';
+    
+    header->scalex=header->scaley=header->scalez=1.0f;
+    
+    if (strncmp(str,"PVM\n",4)!=0)
+    {
+        if (strncmp(str,"PVM2\n",5)==0) version=2;
+        else if (strncmp(str,"PVM3\n",5)==0) version=3;
+        else return(0);
+        
+        ptr=&str[5];
+        if (sscanf(ptr,"%u %u %u\n%g %g %g\n",&header->width,&header->height,&header->depth,
+                   &header->scalex,&header->scaley,&header->scalez)!=6) return(-1);
+        if (header->scalex<=0.0f || header->scaley<=0.0f || header->scalez<=0.0f) return(-1);
+        if ((ptr=strchr(ptr,'\n'))==NULL) return(-1);
+        ptr++;
+    }
+    else
+    {
+        ptr=&str[4];
+        while (*ptr=='#')
+            while (*ptr!='\0' && *ptr++!='\n');
+        
+        if (sscanf(ptr,"%u %u %u\n",&header->width,&header->height,&header->depth)!=3) return(-1);
+    }
+    
+    if (header->width<1 || header->height<1 || header->depth<1) return(-1);
+    
+    if ((ptr=strchr(ptr,'\n'))==NULL) return(-1);
+    ptr++;
+    if (sscanf(ptr,"%u\n",&header->components)!=1) return(-1);
+    if (header->components<1) return(-1);
+    if ((ptr=strchr(ptr,'\n'))==NULL) return(-1);
+    ptr++;
+    
+    header->offset=ptr-str;
+    
+    return(version);
+}
+
+// size of the PVM volume starting at data as told by its header, 0 if unknown
+unsigned int DDS_pvmsize(const uint8_t *data,unsigned int bytes)
+{
+    DDS_pvmheader header;
+    int version;
+    
+    unsigned long long size;
+    
+    if ((version=DDS_parsepvm(data,bytes,&header))<=0) return(0);
+    
+    // leave some room for the strings that follow the voxels of a PVM3 volume
+    size=header.offset+(unsigned long long)header.width*header.height*header.depth*header.components+
+            ((version==3)?4*DDS_MAXSTR:0);
+    
+    return((size<0xffffffffull)?(unsigned int)size:0);
+}
+
+}
+
+DDSDecoder::~DDSDecoder()
+{
+    clearbits();
+}
+
+std::nullptr_t DDSDecoder::fail(const QString &message)
+{
+    error = message;
+    return nullptr;
+}
+
+void DDSDecoder::initbuffer()
+{
+    buffer=0;
+    bufsize=0;
+}
+
+void DDSDecoder::clearbits()
+{
+    free(cache);
+    
+    cache=NULL;
+    cachepos=0;
+    cachesize=0;
+}
+
+// takes ownership of data
+bool DDSDecoder::loadbits(uint8_t *data,unsigned int size)
+{
+    clearbits();
+    
+    cache=data;
+    cachesize=size;
+    
+    if ((data=(uint8_t *)realloc(cache,4*((cachesize+3)/4)+4))==NULL) return(fail("Out of memory"),false);
+    cache=data;
+    
+    *((unsigned int *)&cache[cachesize])=0;
+    
+    cachesize=4*((cachesize+3)/4);
+    
+    return(true);
+}
+
+unsigned int DDSDecoder::readbits(unsigned int bits)
+{
+    unsigned int value;
+    
+    if (bits<bufsize)
+    {
+        bufsize-=bits;
+        value=DDS_shiftr(buffer,bufsize);
+    }
+    else
+    {
+        value=DDS_shiftl(buffer,bits-bufsize);
+        
+        if (cachepos>=cachesize) buffer=0;
+        else
+        {
+            buffer=*((unsigned int *)&cache[cachepos]);
+            if (DDS_ISINTEL()) DDS_swapuint(&buffer);
+            cachepos+=4;
+        }
+        
+        bufsize+=32-bits;
+        value|=DDS_shiftr(buffer,bufsize);
+    }
+    
+    buffer&=DDS_shiftl(1,bufsize)-1;
+    
+    return(value);
+}
+
+// deinterleave a byte stream
+bool DDSDecoder::deinterleave(uint8_t *data,unsigned int bytes,unsigned int skip,unsigned int block,bool restore)
+{
+    unsigned int k;
+    
+    uint8_t *data2;
+    
+    if (skip<=1) return(true);
+    
+    if (block==0)
+    {
+        if ((data2=(uint8_t *)malloc(bytes))==NULL) return(fail("Out of memory"),false);
+        
+        DDS_deinterleaveblock(data,bytes,skip,data2,restore);
+    }
+    else
+    {
+        if ((data2=(uint8_t *)malloc((bytes<skip*block)?bytes:skip*block))==NULL) return(fail("Out of memory"),false);
+        
+        for (k=0; k<bytes/skip/block; k++)
+            DDS_deinterleaveblock(data+k*skip*block,skip*block,skip,data2,restore);
+        
+        DDS_deinterleaveblock(data+k*skip*block,bytes-k*skip*block,skip,data2,restore);
+    }
+    
+    free(data2);
+    
+    return(true);
+}
+
+// interleave a byte stream
+bool DDSDecoder::interleave(uint8_t *data,unsigned int bytes,unsigned int skip,unsigned int block)
+{return(deinterleave(data,bytes,skip,block,true));}
+
+// decode a Differential Data Stream, takes ownership of chunk
+bool DDSDecoder::decode(uint8_t *chunk,unsigned int size,
+                        uint8_t **data,unsigned int *bytes,
+                        unsigned int block)
+{
+    unsigned int skip,strip;
+    
+    uint8_t *ptr1,*ptr2,*tmp;
+    
+    unsigned int cnt,cnt1,cnt2;
+    int bits,act;
+    
+    unsigned int capacity,blocksize,done;
+    
+    QVector<QFuture<bool>> pending;
+    bool ok=true;
+    
+    initbuffer();
+    
+    if (!loadbits(chunk,size)) return(false);
+    
+    skip=readbits(2)+1;
+    strip=readbits(16)+1;
+    
+    ptr1=ptr2=NULL;
+    cnt=act=0;
+    capacity=0;
+    
+    // v3e streams are interleaved in independent blocks, finished blocks
+    // are restored by worker threads while decoding goes on
+    blocksize=(skip>1)?skip*block:0;
+    done=0;
+    
+    // waits for the workers, the output must not move while they run
+    auto finish = [&]()
+    {
+        for (QFuture<bool> &f : pending) ok=f.result() && ok;
+        pending.clear();
+    };
+    
+    auto dispatch = [&](unsigned int offset,unsigned int length)
+    {
+        if (pending.size()>=QThread::idealThreadCount()) finish();
+        
+        uint8_t *base=ptr1+offset;
+        
+        pending.append(QtConcurrent::run([base,length,skip]()
+        {
+            uint8_t *tmp;
+            
+            if ((tmp=(uint8_t *)malloc(length))==NULL) return(false);
+            
+            DDS_deinterleaveblock(base,length,skip,tmp,true);
+            free(tmp);
+            
+            return(true);
+        }));
+    };
+    
+    auto reserve = [&](unsigned int length)
+    {
+        finish();
+        
+        if ((tmp=(uint8_t *)realloc(ptr1,length))==NULL) return(false);
+        
+        ptr1=tmp;
+        ptr2=&ptr1[cnt];
+        capacity=length;
+        
+        return(true);
+    };
+    
+    // grows the output to the final size once the PVM header is readable
+    auto presize = [&]()
+    {
+        unsigned int length=DDS_pvmsize(ptr1,cnt);
+        
+        return(length<=capacity || reserve(length));
+    };
+    
+    auto oom = [&]()
+    {
+        finish();
+        free(ptr1);
+        clearbits();
+        
+        return(fail("Out of memory"),false);
+    };
+    
+    while ((cnt1=readbits(DDS_RL))!=0)
+    {
+        bits=DDS_decode(readbits(3));
+        
+        for (cnt2=0; cnt2<cnt1; cnt2++)
+        {
+            if (strip==1 || cnt<=strip) act+=readbits(bits)-(1<<bits)/2;
+            else act+=*(ptr2-strip)-*(ptr2-strip-1)+readbits(bits)-(1<<bits)/2;
+            
+            while (act<0) act+=256;
+            while (act>255) act-=256;
+            
+            // grow geometrically if the header didn't tell the size
+            if (cnt==capacity)
+                if (!reserve((capacity<DDS_BLOCKSIZE)?DDS_BLOCKSIZE:(capacity<0x80000000u)?2*capacity:0xffffffffu)) return(oom());
+            
+            *ptr2++=act;
+            cnt++;
+            
+            if (blocksize>0)
+            {
+                // a block can be restored once the predictor doesn't look back into it anymore
+                if (cnt-done==blocksize+strip+1)
+                {
+                    if (done==0)
+                    {
+                        // the first block holds the header, restore it right away
+                        if ((tmp=(uint8_t *)malloc(blocksize))==NULL) return(oom());
+                        
+                        DDS_deinterleaveblock(ptr1,blocksize,skip,tmp,true);
+                        free(tmp);
+                        
+                        if (!presize()) return(oom());
+                    }
+                    else dispatch(done,blocksize);
+                    
+                    done+=blocksize;
+                }
+            }
+            else if (skip==1 && cnt==DDS_MAXHEADER)
+                if (!presize()) return(oom());
+        }
+    }
+    
+    clearbits();
+    
+    if (blocksize>0)
+    {
+        for (; cnt-done>=blocksize; done+=blocksize) dispatch(done,blocksize);
+        
+        if (cnt>done)
+        {
+            if ((tmp=(uint8_t *)malloc(cnt-done))==NULL) return(oom());
+            
+            DDS_deinterleaveblock(ptr1+done,cnt-done,skip,tmp,true);
+            free(tmp);
+        }
+        
+        finish();
+        
+        if (!ok)
+        {
+            free(ptr1);
+            return(fail("Out of memory"),false);
+        }
+    }
+    else if (!interleave(ptr1,cnt,skip,block))
+    {
+        free(ptr1);
+        return(false);
+    }
+    
+    if (ptr1!=NULL && capacity>cnt)
+        if ((tmp=(uint8_t *)realloc(ptr1,cnt))!=NULL) ptr1=tmp;
+    
+    *data=ptr1;
+    *bytes=cnt;
+    
+    return(true);
+}
+
+// read from a RAW file
+uint8_t *DDSDecoder::readRAWfiled(FILE *file,unsigned int *bytes)
+{
+    uint8_t *data,*tmp;
+    unsigned int cnt,blkcnt;
+    
+    long pos,end;
+    
+    data=NULL;
+    cnt=0;
+    
+    // read the rest of the file at once if its size is known
+    if ((pos=ftell(file))>=0 && fseek(file,0,SEEK_END)==0)
+    {
+        end=ftell(file);
+        
+        if (fseek(file,pos,SEEK_SET)!=0) return(fail("Could not read file"));
+        
+        if (end>pos && (unsigned long)(end-pos)>=0xffffffffu) return(fail("The volume exceeds the format's 4 GiB limit"));
+        
+        if (end>pos)
+        {
+            if ((data=(uint8_t *)malloc(end-pos))==NULL) return(fail("Out of memory"));
+            
+            cnt=fread(data,1,end-pos,file);
+        }
+    }
+    else
+    {
+        do
+        {
+            if (cnt>0xffffffffu-DDS_BLOCKSIZE)
+            {
+                free(data);
+                return(fail("The volume exceeds the format's 4 GiB limit"));
+            }
+            
+            if ((tmp=(uint8_t *)realloc(data,cnt+DDS_BLOCKSIZE))==NULL)
+            {
+                free(data);
+                return(fail("Out of memory"));
+            }
+        
+            data=tmp;
+        
+            blkcnt=fread(&data[cnt],1,DDS_BLOCKSIZE,file);
+            cnt+=blkcnt;
+        }
+        while (blkcnt==DDS_BLOCKSIZE);
+    }
+    
+    if (cnt==0)
+    {
+        free(data);
+        return(fail("The file is empty"));
+    }
+    
+    if ((tmp=(uint8_t *)realloc(data,cnt))!=NULL) data=tmp;
+    
+    *bytes=cnt;
+    
+    return(data);
+}
+
+// read a RAW file
+uint8_t *DDSDecoder::readRAWfile(const char *filename, unsigned int *bytes)
+{
+    FILE *file;
+    
+    uint8_t *data;
+    
+    if ((file=fopen(filename,"rb"))==NULL) return(fail(QString("Could not open %1").arg(filename)));
+    
+    data=readRAWfiled(file,bytes);
+    
+    fclose(file);
+    
+    return(data);
+}
+
+// read a Differential Data Stream
+uint8_t *DDSDecoder::readDDSfile(const char *filename, unsigned int *bytes)
+{
+    int version=1;
+    
+    FILE *file;
+    
+    int cnt;
+    
+    uint8_t *chunk,*data;
+    unsigned int size;
+    
+    if ((file=fopen(filename,"rb"))==NULL) {
+        return(fail(QString("Could not open %1").arg(filename)));
+    }
+    
+    for (cnt=0; DDS_ID[cnt]!='\0'; cnt++) {
+        if (fgetc(file)!=DDS_ID[cnt])
+        {
+            version=0;
+            break;
+        }
+    }
+    
+    if (version==0)
+    {
+        rewind(file);
+        
+        for (cnt=0; DDS_ID2[cnt]!='\0'; cnt++)
+            if (fgetc(file)!=DDS_ID2[cnt])
+            {
+                fclose(file);
+                return(fail("Not a DDS file"));
+            }
+        
+        version=2;
+    }
+    
+    chunk=readRAWfiled(file,&size);
+    
+    fclose(file);
+    
+    if (chunk==NULL) return(NULL);
+    
+    if (!decode(chunk,size,&data,bytes,version==1?0:DDS_INTERLEAVE)) return(NULL);
+    
+    return(data);
+}
+
+// read a possibly compressed PNM image
+uint8_t *DDSDecoder::readPNMimage(const char *filename,unsigned int *width,unsigned int *height,unsigned int *components)
+{
+    const int maxstr=100;
+    
+    char str[maxstr];
+    
+    uint8_t *data,*ptr1,*ptr2;
+    unsigned int bytes;
+    
+    int pnmtype,maxval;
+    uint8_t *image;
+    
+    if ((data=readDDSfile(filename,&bytes))==NULL)
+        if ((data=readRAWfile(filename,&bytes))==NULL) return(NULL);
+    
+    // frees data and reports a malformed file
+    auto corrupt = [&]() {
+        free(data);
+        return(fail("Corrupt PNM image"));
+    };
+    
+    if (bytes<4) return(corrupt());
+    
+    memcpy(str,data,3);
+    str[3]='\0';
+    
+    if (sscanf(str,"P%1d\n",&pnmtype)!=1) return(corrupt());
+    
+    ptr1=data+3;
+    while (*ptr1=='\n' || *ptr1=='#')
+    {
+        while (*ptr1=='\n')
+            if (++ptr1>=data+bytes) return(corrupt());
+        while (*ptr1=='#')
+            if (++ptr1>=data+bytes) return(corrupt());
+            else
+                while (*ptr1!='\n')
+                    if (++ptr1>=data+bytes) return(corrupt());
+    }
+    
+    ptr2=ptr1;
+    while (*ptr2!='\n' && *ptr2!=' ')
+        if (++ptr2>=data+bytes) return(corrupt());
+    if (++ptr2>=data+bytes) return(corrupt());
+    while (*ptr2!='\n' && *ptr2!=' ')
+        if (++ptr2>=data+bytes) return(corrupt());
+    if (++ptr2>=data+bytes) return(corrupt());
+    while (*ptr2!='\n' && *ptr2!=' ')
+        if (++ptr2>=data+bytes) return(corrupt());
+    if (++ptr2>=data+bytes) return(corrupt());
+    
+    if (ptr2-ptr1>=maxstr) return(corrupt());
+    memcpy(str,ptr1,ptr2-ptr1);
+    str[ptr2-ptr1]='\0';
+    
+    if (sscanf(str,"%d %d\n%d\n",width,height,&maxval)!=3) return(corrupt());
+    
+    if (*width<1 || *height<1) return(corrupt());
+    
+    if (pnmtype==5 && maxval==255) *components=1;
+    else if (pnmtype==5 && (maxval==32767 || maxval==65535)) *components=2;
+    else if (pnmtype==6 && maxval==255) *components=3;
+    else return(corrupt());
+    
+    if (data+bytes!=ptr2+(*width)*(*height)*(*components)) return(corrupt());
+    if ((image=(uint8_t *)malloc((*width)*(*height)*(*components)))==NULL)
+    {
+        free(data);
+        return(fail("Out of memory"));
+    }
+    
+    memcpy(image,ptr2,(*width)*(*height)*(*components));
+    free(data);
+    
+    return(image);
+}
+
+// read a compressed PVM volume
+uint8_t *DDSDecoder::readPVMvolume(const char *filename,
+                                   unsigned int *width,unsigned int *height,unsigned int *depth,unsigned int *components,
+                                   float *scalex,float *scaley,float *scalez,
+                                   uint8_t **description,
+                                   uint8_t **courtesy,
+                                   uint8_t **parameter,
+                                   uint8_t **comment,
+                                   uint8_t **buffer)
+{
+    uint8_t *data,*volume;
+    unsigned int bytes,voxels,pos;
+    
+    DDS_pvmheader header;
+    int version;
+    
+    unsigned int len[4]={0,0,0,0};
+    
+    if ((data=readDDSfile(filename,&bytes))==NULL)
+        if ((data=readRAWfile(filename,&bytes))==NULL) return(NULL);
+    
+    // frees data and reports a malformed file
+    auto corrupt = [&]() {
+        free(data);
+        return(fail("Corrupt PVM header"));
+    };
+    
+    if ((version=DDS_parsepvm(data,bytes,&header))==0)
+    {
+        free(data);
+        return(fail("Not a PVM volume"));
+    }
+    
+    if (version<0) return(corrupt());
+    
+    if (components!=NULL) *components=header.components;
+    else if (header.components!=1) return(corrupt());
+    
+    *width=header.width;
+    *height=header.height;
+    *depth=header.depth;
+    
+    if (scalex!=NULL && scaley!=NULL && scalez!=NULL)
+    {
+        *scalex=header.scalex;
+        *scaley=header.scaley;
+        *scalez=header.scalez;
+    }
+    
+    if ((unsigned long long)header.width*header.height*header.depth*header.components>bytes-header.offset) return(corrupt());
+    voxels=header.width*header.height*header.depth*header.components;
+    
+    // the strings of a PVM3 volume follow the voxels, each one zero terminated
+    pos=header.offset+voxels;
+    if (version==3)
+        for (int i=0; i<4; i++)
+        {
+            if (pos>=bytes) return(corrupt());
+            len[i]=strnlen((char *)&data[pos],bytes-pos)+1;
+            pos+=len[i];
+        }
+    
+    if (pos!=bytes) return(corrupt());
+    
+    // hand out the voxels where they were decoded, or move them to the front of the buffer
+    if (buffer!=NULL)
+    {
+        *buffer=data;
+        volume=data+header.offset;
+    }
+    else
+    {
+        memmove(data,data+header.offset,bytes-header.offset);
+        volume=data;
+    }
+    
+    if (description!=NULL && len[0]>1) *description=volume+voxels;
+    if (courtesy!=NULL && len[1]>1) *courtesy=volume+voxels+len[0];
+    if (parameter!=NULL && len[2]>1) *parameter=volume+voxels+len[0]+len[1];
+    if (comment!=NULL && len[3]>1) *comment=volume+voxels+len[0]+len[1]+len[2];
+    
+    return(volume);
+}
+
+namespace {
+
+// number of bits to store a difference with, there are no 1 bit runs
+inline int DDS_bits(int diff)
+{
+    int bits;
+    
+    if (diff<=0)
+        for (bits=0; (1<<bits)/2<-diff; bits++) ;
+    else
+        for (bits=0; (1<<bits)/2<=diff; bits++) ;
+    
+    return((bits==1)?2:bits);
+}
+
+// big endian bit stream written most significant bit first
+struct DDS_bitstream
+{
+    std::vector<unsigned int> words;
+    
+    unsigned long long buffer=0;
+    unsigned int bufsize=0;
+    
+    void writebits(unsigned int value,unsigned int bits)
+    {
+        buffer=(buffer<<bits)|value;
+        bufsize+=bits;
+        
+        if (bufsize>=32)
+        {
+            bufsize-=32;
+            words.push_back((unsigned int)(buffer>>bufsize));
+            buffer&=(1ull<<bufsize)-1;
+        }
+    }
+    
+    void append(const DDS_bitstream &stream)
+    {
+        for (unsigned int word : stream.words) writebits(word,32);
+        
+        if (stream.bufsize>0) writebits((unsigned int)stream.buffer,stream.bufsize);
+    }
+};
+
+// encode the bytes [begin,end) of a stream as runs of equally wide differences
+void DDS_encodechunk(const uint8_t *data,unsigned int begin,unsigned int end,unsigned int strip,DDS_bitstream *stream)
+{
+    unsigned int i,k,cnt,look;
+    int pre,act,bits,next;
+    
+    std::vector<int> diff(end-begin);
+    std::vector<int> width(end-begin);
+    
+    // same prediction as in DDSDecoder::decode
+    for (i=begin; i<end; i++)
+    {
+        pre=(i>0)?data[i-1]:0;
+        if (strip>1 && i>strip) pre+=data[i-strip]-data[i-strip-1];
+        
+        act=(data[i]-pre)&255;
+        if (act>127) act-=256;
+        
+        diff[i-begin]=act;
+        width[i-begin]=DDS_bits(act);
+    }
+    
+    for (i=0; i<end-begin; i+=cnt)
+    {
+        bits=width[i];
+        
+        for (cnt=1; cnt<(1<<DDS_RL)-1 && i+cnt<end-begin; cnt++)
+        {
+            next=width[i+cnt];
+            
+            if (next>bits)
+            {
+                // widen the run as long as that is cheaper than a new run header
+                if (cnt*(next-bits)>DDS_RL+3) break;
+                bits=next;
+            }
+            else if (next<bits)
+            {
+                // start a new run if enough narrower differences follow
+                look=(DDS_RL+3)/(bits-next)+1;
+                for (k=1; k<look && i+cnt+k<end-begin && width[i+cnt+k]<=next; k++) ;
+                if (k==look) break;
+            }
+        }
+        
+        stream->writebits(cnt,DDS_RL);
+        stream->writebits(DDS_code(bits),3);
+        
+        for (k=0; k<cnt; k++) stream->writebits(diff[i+k]+(1<<bits)/2,bits);
+    }
+}
+
+}
+
+bool DDSEncoder::fail(const QString &message)
+{
+    error = message;
+    return false;
+}
+
+// encode a Differential Data Stream into file, data is interleaved in place
+bool DDSEncoder::encode(uint8_t *data,unsigned int bytes,unsigned int skip,unsigned int strip,FILE *file,unsigned int block)
+{
+    unsigned int blocksize=skip*block;
+    unsigned int chunks=(bytes+DDS_BLOCKSIZE-1)/DDS_BLOCKSIZE;
+    
+    std::atomic<bool> ok(true);
+    
+    // the decoder restores every interleave block on its own
+    if (skip>1)
+        parallelFor((bytes+blocksize-1)/blocksize,[&](size_t begin,size_t end)
+        {
+            uint8_t *tmp;
+            
+            if ((tmp=(uint8_t *)malloc(blocksize))==NULL)
+            {
+                ok=false;
+                return;
+            }
+            
+            for (size_t k=begin; k<end; k++)
+                DDS_deinterleaveblock(data+k*blocksize,qMin(blocksize,(unsigned int)(bytes-k*blocksize)),skip,tmp,false);
+            
+            free(tmp);
+        },1);
+    
+    if (!ok) return(fail("Out of memory"));
+    
+    // the predictor only reads the input, so the chunks are independent
+    std::vector<DDS_bitstream> streams(chunks);
+    
+    parallelFor(chunks,[&](size_t begin,size_t end)
+    {
+        for (size_t k=begin; k<end; k++)
+            DDS_encodechunk(data,k*DDS_BLOCKSIZE,qMin(bytes,(unsigned int)((k+1)*DDS_BLOCKSIZE)),strip,&streams[k]);
+    },1);
+    
+    DDS_bitstream stream;
+    
+    stream.writebits(skip-1,2);
+    stream.writebits(strip-1,16);
+    
+    for (DDS_bitstream &chunk : streams)
+    {
+        stream.append(chunk);
+        std::vector<unsigned int>().swap(chunk.words);
+    }
+    
+    stream.writebits(0,DDS_RL);
+    
+    if (stream.bufsize>0) stream.writebits(0,32-stream.bufsize);
+    
+    if (DDS_ISINTEL())
+        for (unsigned int &word : stream.words) DDS_swapuint(&word);
+    
+    if (fwrite(stream.words.data(),4,stream.words.size(),file)!=stream.words.size()) return(fail("Could not write file"));
+    
+    return(true);
+}
+
+// write a Differential Data Stream, takes ownership of data
+bool DDSEncoder::writeDDS(const char *filename,uint8_t *data,unsigned int bytes,unsigned int skip,unsigned int strip)
+{
+    FILE *file;
+    
+    bool ok;
+    
+    if (skip<1 || skip>4) skip=1;
+    if (strip<1 || strip>65536) strip=1;
+    
+    if ((file=fopen(filename,"wb"))==NULL)
+    {
+        free(data);
+        return(fail(QString("Could not open %1").arg(filename)));
+    }
+    
+    if (fwrite(DDS_ID2,1,strlen(DDS_ID2),file)!=strlen(DDS_ID2)) ok=fail("Could not write file");
+    else ok=encode(data,bytes,skip,strip,file,DDS_INTERLEAVE);
+    
+    free(data);
+    
+    if (fclose(file)!=0 && ok) return(fail("Could not write file"));
+    
+    return(ok);
+}
+
+// write a Differential Data Stream
+bool DDSEncoder::writeDDSfile(const char *filename,const uint8_t *data,unsigned int bytes,unsigned int skip,unsigned int strip)
+{
+    uint8_t *copy;
+    
+    if (bytes<1) return(fail("Nothing to write"));
+    
+    if ((copy=(uint8_t *)malloc(bytes))==NULL) return(fail("Out of memory"));
+    
+    memcpy(copy,data,bytes);
+    
+    return(writeDDS(filename,copy,bytes,skip,strip));
+}
+
+// write a compressed PVM volume
+bool DDSEncoder::writePVMvolume(const char *filename,const uint8_t *volume,
+                                unsigned int width,unsigned int height,unsigned int depth,unsigned int components,
+                                float scalex,float scaley,float scalez,
+                                const uint8_t *description,
+                                const uint8_t *courtesy,
+                                const uint8_t *parameter,
+                                const uint8_t *comment,
+                                bool swap)
+{
+    char header[DDS_MAXHEADER];
+    int len;
+    
+    const uint8_t *strings[4]={description,courtesy,parameter,comment};
+    unsigned int lens[4]={0,0,0,0};
+    
+    unsigned long long voxels,bytes;
+    uint8_t *data,*ptr;
+    
+    bool version3=false;
+    
+    if (width<1 || height<1 || depth<1 || components<1) return(fail("Nothing to write"));
+    
+    for (int i=0; i<4; i++) version3=version3 || strings[i]!=NULL;
+    
+    len=snprintf(header,DDS_MAXHEADER,"%s\n%u %u %u\n%g %g %g\n%u\n",version3?"PVM3":"PVM2",
+                 width,height,depth,scalex,scaley,scalez,components);
+    
+    voxels=(unsigned long long)width*height*depth*components;
+    bytes=len+voxels;
+    
+    if (version3)
+        for (int i=0; i<4; i++)
+        {
+            lens[i]=(strings[i]!=NULL)?strlen((const char *)strings[i])+1:1;
+            bytes+=lens[i];
+        }
+    
+    if (bytes>=0xffffffffull) return(fail("The volume is too large for a PVM file"));
+    
+    if ((data=(uint8_t *)malloc(bytes))==NULL) return(fail("Out of memory"));
+    
+    memcpy(data,header,len);
+    ptr=data+len;
+    
+    if (swap && components==2)
+        parallelFor(voxels/2,[&](size_t begin,size_t end)
+        {
+            for (size_t i=begin; i<end; i++)
+            {
+                ptr[2*i]=volume[2*i+1];
+                ptr[2*i+1]=volume[2*i];
+            }
+        });
+    else
+        memcpy(ptr,volume,voxels);
+    
+    ptr+=voxels;
+    
+    if (version3)
+        for (int i=0; i<4; i++)
+        {
+            if (strings[i]!=NULL) memcpy(ptr,strings[i],lens[i]);
+            else *ptr='\0';
+            
+            ptr+=lens[i];
+        }
+    
+    return(writeDDS(filename,data,bytes,components,width));
+}
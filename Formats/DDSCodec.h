@@ -0,0 +1,101 @@
+// (c) by Stefan Roettger, licensed under GPL 2+
+// see https://code.google.com/p/vvv/
+
+#ifndef DDSCODEC_H
+#define DDSCODEC_H
+
+#include <QString>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/**
+ * Reader for (possibly DDS compressed) PVM volumes and PNM images.
+ *
+ * All bit stream state lives in the object, so every thread can decode
+ * with its own instance. Errors don't terminate the program, the read
+ * functions return nullptr and errorString() tells what went wrong.
+ * Returned buffers are allocated with malloc and have to be free'd.
+ *
+ * readPVMvolume parses the header and the strings in place. Without the
+ * buffer argument the voxels are moved to the front of the decoded data,
+ * with it they stay where they are and *buffer receives the block to free.
+ */
+class DDSDecoder
+{
+public:
+    ~DDSDecoder();
+    
+    uint8_t *readPVMvolume(const char *filename,
+                           unsigned int *width, unsigned int *height, unsigned int *depth, unsigned int *components=NULL,
+                           float *scalex=NULL, float *scaley=NULL, float *scalez=NULL,
+                           uint8_t **description=NULL,
+                           uint8_t **courtesy=NULL,
+                           uint8_t **parameter=NULL,
+                           uint8_t **comment=NULL,
+                           uint8_t **buffer=NULL);
+    
+    uint8_t *readPNMimage(const char *filename, unsigned int *width, unsigned int *height, unsigned int *components);
+    
+    uint8_t *readDDSfile(const char *filename, unsigned int *bytes);
+    uint8_t *readRAWfile(const char *filename, unsigned int *bytes);
+    
+    const QString &errorString() const {return error;}
+
+private:
+    void initbuffer();
+    void clearbits();
+    bool loadbits(uint8_t *data, unsigned int size);
+    unsigned int readbits(unsigned int bits);
+    
+    bool deinterleave(uint8_t *data, unsigned int bytes, unsigned int skip, unsigned int block=0, bool restore=false);
+    bool interleave(uint8_t *data, unsigned int bytes, unsigned int skip, unsigned int block=0);
+    
+    bool decode(uint8_t *chunk, unsigned int size, uint8_t **data, unsigned int *bytes, unsigned int block=0);
+    
+    uint8_t *readRAWfiled(FILE *file, unsigned int *bytes);
+    
+    std::nullptr_t fail(const QString &message);
+    
+    uint8_t *cache = nullptr;
+    unsigned int cachepos = 0, cachesize = 0;
+    
+    unsigned int buffer = 0;
+    unsigned int bufsize = 0;
+    
+    QString error;
+};
+
+/**
+ * Writer for DDS compressed PVM volumes, the counterpart of DDSDecoder.
+ *
+ * The stream is split into chunks which are encoded in parallel and
+ * joined afterwards, the output decodes like any other DDS v3e file.
+ */
+class DDSEncoder
+{
+public:
+    /// swap exchanges the bytes of 16 bit voxels, PVM stores them big endian
+    bool writePVMvolume(const char *filename, const uint8_t *volume,
+                        unsigned int width, unsigned int height, unsigned int depth, unsigned int components=1,
+                        float scalex=1.0f, float scaley=1.0f, float scalez=1.0f,
+                        const uint8_t *description=NULL,
+                        const uint8_t *courtesy=NULL,
+                        const uint8_t *parameter=NULL,
+                        const uint8_t *comment=NULL,
+                        bool swap=false);
+    
+    bool writeDDSfile(const char *filename, const uint8_t *data, unsigned int bytes, unsigned int skip=0, unsigned int strip=0);
+    
+    const QString &errorString() const {return error;}
+
+private:
+    bool encode(uint8_t *data, unsigned int bytes, unsigned int skip, unsigned int strip, FILE *file, unsigned int block);
+    bool writeDDS(const char *filename, uint8_t *data, unsigned int bytes, unsigned int skip, unsigned int strip);
+    
+    bool fail(const QString &message);
+    
+    QString error;
+};
+
+#endif // DDSCODEC_H
@@ -8,6 +8,7 @@ class DDSLoader : public Loader
 {
 public:
     uint8_t *loadFile(const QString &filename) override;
+    QString cacheKey() const override;
 
 };
 
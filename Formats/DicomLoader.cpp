@@ -2,114 +2,172 @@
 
 #include <QDebug>
 
+#include <atomic>
+#include <cstring>
+
+#include "common.h"
 #include "lib/imebra/include/imebra.h"
 
-DicomLoader::DicomLoader()
-{
-}
+using namespace puntoexe;
+using namespace puntoexe::imebra;
 
-uint8_t *DicomLoader::loadFile(const QString &filename)
+namespace {
+
+/// Center and width of the presentation VOI, shared by the chains of all threads
+struct VOISettings {
+    imbxUint32 lutId = 0;
+    imbxInt32 center = 0, width = 0;
+};
+
+/**
+ * Builds the transforms that turn a frame of dataSet into MONOCHROME2,
+ * without the presentation VOI if voi is nullptr. The chains keep state
+ * while they run, so every thread needs its own.
+ */
+ptr<transforms::transformsChain> buildChain(ptr<dataSet> dataSet, ptr<image> firstImage, const VOISettings *voi)
 {
-    using namespace puntoexe;
-    
-    ptr<stream> readStream(new stream);
-    readStream->openFile(filename.toStdWString(), std::ios::in);
-    ptr<streamReader> reader(new streamReader(readStream));
-    ptr<imebra::dataSet> loadedDataSet = 
-            imebra::codecs::codecFactory::getCodecFactory()->load(reader);
-    
-    // Get the first image. We use it in case there isn't any presentation VOI/LUT
-    //  and we have to calculate the optimal one
-    ptr<imebra::image> dataSetImage(loadedDataSet->getImage(0));
-    dataSetImage->getSize(&width, &height);
-    
-    using namespace puntoexe::imebra;
-    
-    // Build the transforms chain
     ptr<transforms::transformsChain> chain(new transforms::transformsChain);
-
-    ptr<transforms::modalityVOILUT> modalityVOILUT(new transforms::modalityVOILUT(loadedDataSet));
+    
+    ptr<transforms::modalityVOILUT> modalityVOILUT(new transforms::modalityVOILUT(dataSet));
     chain->addTransform(modalityVOILUT);
-
+    
     ptr<transforms::colorTransforms::colorTransformsFactory> colorFactory(transforms::colorTransforms::colorTransformsFactory::getColorTransformsFactory());
-    if(colorFactory->isMonochrome(dataSetImage->getColorSpace()))
+    if(colorFactory->isMonochrome(firstImage->getColorSpace()))
     {
         // Convert to MONOCHROME2 if a modality transform is not present
         ////////////////////////////////////////////////////////////////
         if(modalityVOILUT->isEmpty())
         {
-            ptr<transforms::colorTransforms::colorTransform> monochromeColorTransform(colorFactory->getTransform(dataSetImage->getColorSpace(), L"MONOCHROME2"));
+            ptr<transforms::colorTransforms::colorTransform> monochromeColorTransform(colorFactory->getTransform(firstImage->getColorSpace(), L"MONOCHROME2"));
             if(monochromeColorTransform != 0)
             {
                 chain->addTransform(monochromeColorTransform);
             }
         }
-
-        ptr<transforms::VOILUT> presentationVOILUT(new transforms::VOILUT(loadedDataSet));
-        imbxUint32 firstVOILUTID(presentationVOILUT->getVOILUTId(0));
-        if(firstVOILUTID != 0)
+        
+        if(voi != nullptr)
         {
-            presentationVOILUT->setVOILUT(firstVOILUTID);
+            ptr<transforms::VOILUT> presentationVOILUT(new transforms::VOILUT(dataSet));
+            if(voi->lutId != 0)
+            {
+                presentationVOILUT->setVOILUT(voi->lutId);
+            }
+            else
+            {
+                presentationVOILUT->setCenterWidth(voi->center, voi->width);
+            }
+            chain->addTransform(presentationVOILUT);
         }
-        else
+    }
+    
+    return chain;
+}
+
+}
+
+DicomLoader::DicomLoader()
+{
+}
+
+QString DicomLoader::cacheKey() const
+{
+    return "dicom " + Loader::cacheKey();
+}
+
+uint8_t *DicomLoader::loadFile(const QString &filename)
+{
+    try {
+        ptr<stream> readStream(new stream);
+        readStream->openFile(filename.toStdWString(), std::ios::in);
+        ptr<streamReader> reader(new streamReader(readStream));
+        ptr<dataSet> loadedDataSet =
+                codecs::codecFactory::getCodecFactory()->load(reader);
+        
+        // Get the first image. We use it in case there isn't any presentation VOI/LUT
+        //  and we have to calculate the optimal one
+        ptr<image> dataSetImage(loadedDataSet->getImage(0));
+        dataSetImage->getSize(&width, &height);
+        
+        // Number of Frames (0028,0008), single frame images don't have it
+        depth = qMax(1u, (unsigned)loadedDataSet->getUnsignedLong(0x0028, 0, 0x0008, 0));
+        
+        ptr<transforms::colorTransforms::colorTransformsFactory> colorFactory(transforms::colorTransforms::colorTransformsFactory::getColorTransformsFactory());
+        
+        VOISettings voi;
+        
+        ptr<transforms::VOILUT> presentationVOILUT(new transforms::VOILUT(loadedDataSet));
+        voi.lutId = presentationVOILUT->getVOILUTId(0);
+        
+        if(voi.lutId == 0 && colorFactory->isMonochrome(dataSetImage->getColorSpace()))
         {
             // Run the transform on the first image
             ///////////////////////////////////////
+            ptr<transforms::transformsChain> chain = buildChain(loadedDataSet, dataSetImage, nullptr);
             ptr<image> temporaryImage = chain->allocateOutputImage(dataSetImage, width, height);
             chain->runTransform(dataSetImage, 0, 0, width, height, temporaryImage, 0, 0);
 
             // Now find the optimal VOILUT
             //////////////////////////////
             presentationVOILUT->applyOptimalVOI(temporaryImage, 0, 0, width, height);
+            presentationVOILUT->getCenterWidth(&voi.center, &voi.width);
         }
-        chain->addTransform(presentationVOILUT);
-    }
         
-    try {
-        // Scan through the frames to count slices
-        // ugly workaround hack because slice count can not be determined
-        for(int frameNumber = 0; ; ++frameNumber)
-        {
-            if(frameNumber != 0)
-            {
-                dataSetImage = loadedDataSet->getImage(frameNumber);
-            }
-
-            ++depth;
-        }
-    }
-    catch(imebra::dataSetImageDoesntExist&e)
-    {
-        // Ignore this exception. It is thrown when we reach the end of the images list
-        exceptionsManager::getMessage();
-    }
-    
-    uint8_t *result = new uint8_t[width*height*depth];
-    int planeSize = width*height;
-    
-    bitDepth = 8;
-    
-    ptr<image> finalImage(new image);
-    finalImage->create(width, height, image::depthU8, L"MONOCHROME2", 8);
-    
-    for(int i=0; i<depth; ++i) {
-        dataSetImage = loadedDataSet->getImage(i);
+        const size_t planeSize = size_t(width)*height;
+        uint8_t *result = new uint8_t[planeSize*depth];
         
-        if(!chain->isEmpty())
-        {
-            chain->runTransform(dataSetImage, 0, 0, width, height, finalImage, 0, 0);
-        }
+        bitDepth = 8;
+        
+        std::atomic<unsigned> framesDone(0);
+        std::atomic<bool> failed(false);
         
-        imbxUint32 rowSize, channelPixelSize, channelsNumber;
-        ptr<imebra::handlers::dataHandlerNumericBase> handler = finalImage->getDataHandler(false, &rowSize, &channelPixelSize, &channelsNumber);
-        uint8_t *pBuffer = handler->getMemoryBuffer();
+        // every thread transforms its own frames into its own image and
+        // copies the rows straight to their place in the volume
+        parallelFor(depth, [&](size_t begin, size_t end) {
+            try {
+                ptr<transforms::transformsChain> chain = buildChain(loadedDataSet, dataSetImage, &voi);
+                
+                ptr<image> finalImage(new image);
+                finalImage->create(width, height, image::depthU8, L"MONOCHROME2", 8);
+                
+                for(size_t i=begin; i<end && !failed && !canceled; ++i) {
+                    ptr<image> frame = loadedDataSet->getImage((imbxUint32)i);
+                    
+                    if(!chain->isEmpty())
+                    {
+                        chain->runTransform(frame, 0, 0, width, height, finalImage, 0, 0);
+                    }
+                    
+                    imbxUint32 rowSize, channelPixelSize, channelsNumber;
+                    ptr<handlers::dataHandlerNumericBase> handler = finalImage->getDataHandler(false, &rowSize, &channelPixelSize, &channelsNumber);
+                    const uint8_t *pBuffer = handler->getMemoryBuffer();
+                    uint8_t *plane = result + i*planeSize;
+                    
+                    for(unsigned y=0; y<height; ++y) {
+                        memcpy(plane + y*width, pBuffer + y*rowSize, width);
+                    }
+                    
+                    reportProgress(++framesDone, depth, "Decoding");
+                }
+            } catch(std::exception &e) {
+                qDebug() << e.what();
+                failed = true;
+            }
+        }, 1);
         
-        int start = i*planeSize;
+        if(canceled) {
+            delete[] result;
+            return canceledLoad();
+        }
         
-        for(int j=0; j<planeSize; ++j) {
-            result[start + j] = pBuffer[j];
+        if(failed) {
+            delete[] result;
+            error = QString("Could not decode all frames of %1").arg(filename);
+            return nullptr;
         }
+        
+        return result;
+    } catch(std::exception &e) {
+        error = QString("Could not read %1: %2").arg(filename, e.what());
+        return nullptr;
     }
-    
-    return result;
 }
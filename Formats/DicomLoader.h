@@ -8,6 +8,7 @@ class DicomLoader : public Loader
 public:
     DicomLoader();
     virtual uint8_t *loadFile(const QString &filename) override;
+    virtual QString cacheKey() const override;
 };
 
 #endif // DICOMLOADER_H
@@ -0,0 +1,249 @@
+#include "DicomSeriesLoader.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QSysInfo>
+#include <QVector>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+#include "common.h"
+#include "lib/imebra/include/imebra.h"
+
+using namespace puntoexe;
+using namespace puntoexe::imebra;
+
+namespace {
+
+struct Slice {
+    QString filename;
+    
+    unsigned width = 0, height = 0;
+    
+    double position = 0;
+    imbxInt32 instance = 0;
+    
+    bool valid = false;
+};
+
+/// Opens a DICOM file, tags bigger than maxBufferLoad are only read when needed
+ptr<dataSet> openDataSet(const QString &filename, imbxUint32 maxBufferLoad = 0xffffffff)
+{
+    ptr<stream> readStream(new stream);
+    readStream->openFile(filename.toStdWString(), std::ios::in);
+    ptr<streamReader> reader(new streamReader(readStream));
+    
+    return codecs::codecFactory::getCodecFactory()->load(reader, maxBufferLoad);
+}
+
+/// Reads what is needed to place a slice, without touching its pixel data
+Slice scanSlice(const QString &filename)
+{
+    Slice slice;
+    slice.filename = filename;
+    
+    try {
+        ptr<dataSet> header = openDataSet(filename, 256);
+        
+        if(header == 0) {
+            return slice;
+        }
+        
+        // Rows (0028,0010) and Columns (0028,0011)
+        slice.height = header->getUnsignedLong(0x0028, 0, 0x0010, 0);
+        slice.width = header->getUnsignedLong(0x0028, 0, 0x0011, 0);
+        
+        // Instance Number (0020,0013)
+        slice.instance = header->getSignedLong(0x0020, 0, 0x0013, 0);
+        
+        // Image Position (0020,0032) projected on the normal of Image Orientation (0020,0037)
+        double row[3], column[3], normal[3], position[3];
+        
+        for(int i=0; i<3; ++i) {
+            row[i] = header->getDouble(0x0020, 0, 0x0037, i);
+            column[i] = header->getDouble(0x0020, 0, 0x0037, i+3);
+            position[i] = header->getDouble(0x0020, 0, 0x0032, i);
+        }
+        
+        normal[0] = row[1]*column[2] - row[2]*column[1];
+        normal[1] = row[2]*column[0] - row[0]*column[2];
+        normal[2] = row[0]*column[1] - row[1]*column[0];
+        
+        slice.position = normal[0]*position[0] + normal[1]*position[1] + normal[2]*position[2];
+        slice.valid = slice.width > 0 && slice.height > 0;
+    } catch(std::exception &e) {
+        // not a DICOM file, it is left out
+    }
+    
+    return slice;
+}
+
+/// Decodes the pixels of a slice to unsigned 16 bit values
+void decodeSlice(const Slice &slice, uint16_t *dst)
+{
+    ptr<dataSet> loadedDataSet = openDataSet(slice.filename);
+    ptr<image> sliceImage = loadedDataSet->getImage(0);
+    
+    imbxUint32 width, height;
+    sliceImage->getSize(&width, &height);
+    
+    if(width != slice.width || height != slice.height) {
+        throw std::runtime_error("slice size does not match its header");
+    }
+    
+    imbxUint32 rowSize, channelPixelSize, channelsNumber;
+    ptr<handlers::dataHandlerNumericBase> handler = sliceImage->getDataHandler(false, &rowSize, &channelPixelSize, &channelsNumber);
+    
+    const uint8_t *pBuffer = handler->getMemoryBuffer();
+    const size_t count = size_t(width)*height;
+    
+    // signed values are shifted into the unsigned range, so all slices share one scale
+    switch(sliceImage->getDepth()) {
+    case image::depthU8:
+        for(size_t i=0; i<count; ++i) {
+            dst[i] = pBuffer[i*channelsNumber] << 8;
+        }
+        break;
+    
+    case image::depthS8:
+        for(size_t i=0; i<count; ++i) {
+            dst[i] = (((const int8_t*)pBuffer)[i*channelsNumber] + 128) << 8;
+        }
+        break;
+    
+    case image::depthU16:
+        for(size_t i=0; i<count; ++i) {
+            dst[i] = ((const uint16_t*)pBuffer)[i*channelsNumber];
+        }
+        break;
+    
+    case image::depthS16:
+        for(size_t i=0; i<count; ++i) {
+            dst[i] = ((const int16_t*)pBuffer)[i*channelsNumber] + 32768;
+        }
+        break;
+    
+    default:
+        for(size_t i=0; i<count; ++i) {
+            dst[i] = qBound<imbxInt32>(0, handler->getSignedLong(i*channelsNumber) + 32768, 65535);
+        }
+        break;
+    }
+}
+
+}
+
+QString DicomSeriesLoader::cacheKey() const
+{
+    return "dicom series " + Loader::cacheKey();
+}
+
+QStringList DicomSeriesLoader::dataFiles(const QString &directory) const
+{
+    // the directory itself doesn't change when a slice is rewritten in place
+    QDir dir(directory);
+    QStringList files;
+    
+    for(const QString &file : dir.entryList(QDir::Files | QDir::Readable, QDir::Name)) {
+        files << dir.filePath(file);
+    }
+    
+    return files;
+}
+
+uint8_t *DicomSeriesLoader::loadFile(const QString &directory)
+{
+    deleter = deleteArray;
+    
+    QDir dir(directory);
+    QStringList files = dir.entryList(QDir::Files | QDir::Readable, QDir::Name);
+    
+    QVector<Slice> slices(files.size());
+    std::atomic<int> scanned(0);
+    
+    parallelFor(files.size(), [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end && !canceled; ++i) {
+            slices[i] = scanSlice(dir.filePath(files[i]));
+            reportProgress(++scanned, files.size(), "Scanning");
+        }
+    }, 1);
+    
+    if(canceled) {
+        return canceledLoad();
+    }
+    
+    slices.erase(std::remove_if(slices.begin(), slices.end(), [](const Slice &s) {
+        return !s.valid;
+    }), slices.end());
+    
+    if(slices.isEmpty()) {
+        error = QString("%1 contains no DICOM slices").arg(directory);
+        return nullptr;
+    }
+    
+    std::stable_sort(slices.begin(), slices.end(), [](const Slice &a, const Slice &b) {
+        return a.position != b.position ? a.position < b.position : a.instance < b.instance;
+    });
+    
+    width = slices.first().width;
+    height = slices.first().height;
+    depth = slices.size();
+    
+    for(const Slice &slice : slices) {
+        if(slice.width != width || slice.height != height) {
+            error = QString("The slices in %1 differ in size").arg(directory);
+            return nullptr;
+        }
+    }
+    
+    bitDepth = 16;
+    
+    const size_t sliceSize = size_t(width)*height;
+    uint16_t *volume = new uint16_t[sliceSize*depth];
+    
+    std::atomic<unsigned> decoded(0);
+    std::atomic<bool> failed(false);
+    
+    parallelFor(depth, [&](size_t begin, size_t end) {
+        for(size_t z=begin; z<end && !failed && !canceled; ++z) {
+            try {
+                decodeSlice(slices[z], volume + z*sliceSize);
+            } catch(std::exception &e) {
+                qDebug() << slices[z].filename << e.what();
+                failed = true;
+            }
+            
+            reportProgress(++decoded, depth, "Decoding");
+        }
+    }, 1);
+    
+    if(canceled) {
+        delete[] volume;
+        return canceledLoad();
+    }
+    
+    if(failed) {
+        delete[] volume;
+        error = QString("Could not decode all slices in %1").arg(directory);
+        return nullptr;
+    }
+    
+    uint8_t *data = (uint8_t*)volume;
+    
+    if(!reportProgress(0, 1, "Normalizing")) {
+        delete[] volume;
+        return canceledLoad();
+    }
+    
+    normalizeData(sliceSize*depth, QSysInfo::ByteOrder == QSysInfo::LittleEndian ? BO_LITTLE_ENDIAN : BO_BIG_ENDIAN,
+                  2, data, data);
+    
+    // the buffer was allocated as uint16_t
+    deleter = [](uint8_t *data) {
+        delete[] (uint16_t*)data;
+    };
+    
+    return data;
+}
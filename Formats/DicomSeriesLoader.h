@@ -0,0 +1,22 @@
+#ifndef DICOMSERIESLOADER_H
+#define DICOMSERIESLOADER_H
+
+#include "Loader.h"
+
+/**
+ * Loads a directory with one DICOM file per slice.
+ *
+ * The headers are scanned in parallel, the slices are ordered by their
+ * position along the slice normal (instance number if there is none) and
+ * decoded concurrently into one 16 bit volume. The stored values are used
+ * as they are, without the modality rescale.
+ */
+class DicomSeriesLoader : public Loader
+{
+public:
+    uint8_t *loadFile(const QString &directory) override;
+    QString cacheKey() const override;
+    QStringList dataFiles(const QString &directory) const override;
+};
+
+#endif // DICOMSERIESLOADER_H
@@ -1,64 +1,207 @@
 #include "Loader.h"
 
 #include <QDebug>
+#include <QMutex>
+#include <QSysInfo>
 #include <qmath.h>
 
-void Loader::findMinMax(int voxelCount, unsigned bytesPerValue, uint8_t *data, unsigned &min, unsigned &max)
+#include <cstring>
+#include <limits>
+
+#include "common.h"
+#include "NormalizeKernels.h"
+
+namespace {
+
+/// Float i of data, whose bytes are swapped if it isn't in host byte order
+inline float readFloat(const uint8_t *data, size_t i, bool swap)
+{
+    uint8_t bytes[4];
+    memcpy(bytes, data + i*4, 4);
+    
+    if(swap) {
+        std::swap(bytes[0], bytes[3]);
+        std::swap(bytes[1], bytes[2]);
+    }
+    
+    float value;
+    memcpy(&value, bytes, 4);
+    
+    return value;
+}
+
+bool isHostOrder(Loader::ByteOrder byteOrder)
+{
+    return byteOrder == (QSysInfo::ByteOrder == QSysInfo::LittleEndian ? Loader::BO_LITTLE_ENDIAN : Loader::BO_BIG_ENDIAN);
+}
+
+void minMaxFloat(size_t voxelCount, Loader::ByteOrder byteOrder, const uint8_t *data, float &min, float &max)
+{
+    const bool swap = !isHostOrder(byteOrder);
+    
+    QMutex mutex;
+    
+    parallelFor(voxelCount, [&](size_t begin, size_t end) {
+        float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+        
+        // nan compares false either way and is left out
+        for(size_t i=begin; i<end; ++i) {
+            float value = readFloat(data, i, swap);
+            
+            lo = value < lo ? value : lo;
+            hi = value > hi ? value : hi;
+        }
+        
+        QMutexLocker lock(&mutex);
+        min = qMin(min, lo);
+        max = qMax(max, hi);
+    });
+}
+
+void swapFloats(size_t voxelCount, const uint8_t *data, uint8_t *dst)
+{
+    parallelFor(voxelCount, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; ++i) {
+            float value = readFloat(data, i, true);
+            memcpy(dst + i*4, &value, 4);
+        }
+    });
+}
+
+void minMax(size_t voxelCount, Loader::ByteOrder byteOrder, unsigned bytesPerValue, const uint8_t *data, unsigned &min, unsigned &max)
 {
-    for(int i=0; i<voxelCount; i++) {
-        unsigned int raw_val;
+    const NormalizeKernels &kernels = normalizeKernels();
+    const bool bigEndian = byteOrder == Loader::BO_BIG_ENDIAN;
+    
+    QMutex mutex;
+    
+    // every thread reduces its own range, the partial results are merged afterwards
+    parallelFor(voxelCount, [&](size_t begin, size_t end) {
+        unsigned lo = ~0u, hi = 0;
         
-        if(bytesPerValue == 2) {
-            raw_val = data[i*2] <<8 | data[i*2+1];
+        if(bytesPerValue == 1) {
+            kernels.minMax8(data + begin, end-begin, lo, hi);
         } else {
-            raw_val = data[i];
+            kernels.minMax16(data + begin*2, end-begin, bigEndian, lo, hi);
         }
         
-        min = qMin(min, raw_val);
-        max = qMax(max, raw_val);
+        QMutexLocker lock(&mutex);
+        min = qMin(min, lo);
+        max = qMax(max, hi);
+    });
+}
+
+void rescale(size_t voxelCount, Loader::ByteOrder byteOrder, unsigned bytesPerValue, const uint8_t *data, unsigned min, float scale, uint8_t *dst)
+{
+    const NormalizeKernels &kernels = normalizeKernels();
+    const bool bigEndian = byteOrder == Loader::BO_BIG_ENDIAN;
+    
+    parallelFor(voxelCount, [&](size_t begin, size_t end) {
+        if(bytesPerValue == 1) {
+            kernels.rescale8to8(data + begin, end-begin, min, scale, dst + begin);
+        } else {
+            kernels.rescale16to8(data + begin*2, end-begin, bigEndian, min, scale, dst + begin);
+        }
+    });
+}
+
+void rescale(size_t voxelCount, Loader::ByteOrder byteOrder, unsigned bytesPerValue, const uint8_t *data, unsigned min, float scale, uint16_t *dst)
+{
+    const NormalizeKernels &kernels = normalizeKernels();
+    const bool bigEndian = byteOrder == Loader::BO_BIG_ENDIAN;
+    
+    parallelFor(voxelCount, [&](size_t begin, size_t end) {
+        if(bytesPerValue == 1) {
+            kernels.rescale8to16(data + begin, end-begin, min, scale, dst + begin);
+        } else {
+            kernels.rescale16to16(data + begin*2, end-begin, bigEndian, min, scale, dst + begin);
+        }
+    });
+}
+
+}
+
+bool Loader::reportProgress(qint64 done, qint64 total, const QString &stage)
+{
+    if(progressCallback) {
+        progressCallback(done, total, stage);
+    }
+    
+    return !canceled;
+}
+
+std::nullptr_t Loader::canceledLoad()
+{
+    error = "Loading was canceled";
+    return nullptr;
+}
+
+void Loader::findMinMax(size_t voxelCount, ByteOrder byteOrder, unsigned bytesPerValue, const uint8_t *data, float &min, float &max)
+{
+    if(bytesPerValue == 4) {
+        minMaxFloat(voxelCount, byteOrder, data, min, max);
+        return;
+    }
+    
+    // the integer kernels only widen their range, starting from an empty one
+    unsigned lo = ~0u, hi = 0;
+    minMax(voxelCount, byteOrder, bytesPerValue, data, lo, hi);
+    
+    if(lo <= hi) {
+        min = qMin(min, float(lo));
+        max = qMax(max, float(hi));
     }
 }
 
-unsigned Loader::scaleHistogram(unsigned val, unsigned min, unsigned max, unsigned rangeMax)
+void Loader::normalizeData(size_t voxelCount, Loader::ByteOrder byteOrder, unsigned dstBytesPerVal, const uint8_t *data, uint8_t *dst)
 {
-    return (val - min) * (double(rangeMax) / (max-min));
+    int bytesPerValue = qCeil(bitDepth/8.);
+    
+    float min = std::numeric_limits<float>::max(), max = std::numeric_limits<float>::lowest();
+    
+    if(findsRange()) {
+        findMinMax(voxelCount, byteOrder, bytesPerValue, data, min, max);
+    }
+    
+    normalizeData(voxelCount, byteOrder, dstBytesPerVal, data, dst, min, max);
 }
 
-void Loader::normalizeData(int voxelCount, Loader::ByteOrder byteOrder, unsigned dstBytesPerVal, uint8_t *data, uint8_t *dst)
+void Loader::normalizeData(size_t voxelCount, Loader::ByteOrder byteOrder, unsigned dstBytesPerVal, const uint8_t *data, uint8_t *dst, float min, float max)
 {
     int bytesPerValue = qCeil(bitDepth/8.);
     
+    // floats are only brought into host byte order
+    if(bytesPerValue == 4) {
+        setValueRange(min, max);
+        
+        if(!isHostOrder(byteOrder)) {
+            swapFloats(voxelCount, data, dst);
+        } else if(data != dst) {
+            memcpy(dst, data, voxelCount*4);
+        }
+        
+        return;
+    }
+    
     unsigned int rangeMax = qPow(2, bitDepth);
-    unsigned int min = rangeMax, max = 0;
     
-    qDebug() << rangeMax;
+    // the values are kept, the renderer maps the window onto the lut
+    float scale = 1;
     
-    if(linearize) {
-        findMinMax(voxelCount, bytesPerValue, data, min, max);
+    if(bytesPerValue == 2 && dstBytesPerVal == 1) {
+        scale = 255.f/rangeMax;
     }
     
-    unsigned raw_val;
-    unsigned val;
+    setValueRange(min*scale, max*scale);
     
-    for(int i=0; i<voxelCount; i++) {
-        if(bytesPerValue == 1) {
-            raw_val = raw_val = data[i];
-        } else {
-            uint16_t *d = (uint16_t*)data;
-            raw_val = (byteOrder == BO_BIG_ENDIAN) ? (data[i*2] <<8 | data[i*2+1]) : d[i];
-        }
+    if(data == dst && bytesPerValue == int(dstBytesPerVal) && (bytesPerValue == 1 || isHostOrder(byteOrder))) {
+        // already in the form the volume is stored in
+        return;
+    }
     
-        if(linearize) {
-            // scale histogram to span the whole available range
-            val = scaleHistogram(raw_val, min, max, rangeMax);
-        } else if(bytesPerValue == 2 && dstBytesPerVal == 1) {
-            val = uint8_t(raw_val/double(rangeMax)*255);
-        }
-        
-        if(dstBytesPerVal == 1) {
-            dst[i] = val;
-        } else {
-            ((uint16_t*)dst)[i] = val;
-        }
+    if(dstBytesPerVal == 1) {
+        rescale(voxelCount, byteOrder, bytesPerValue, data, 0, scale, dst);
+    } else {
+        rescale(voxelCount, byteOrder, bytesPerValue, data, 0, scale, (uint16_t*)dst);
     }
 }
@@ -2,8 +2,15 @@
 #define LOADER_H
 
 #include <QString>
+#include <QStringList>
+#include <QVector3D>
 #include <qmath.h>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+
+/// Releases a buffer handed out by Loader::loadFile
+typedef std::function<void(uint8_t *)> BufferDeleter;
 
 class Loader
 {
@@ -13,6 +20,11 @@ public:
         BO_BIG_ENDIAN = 1
     };
     
+    /// Receives how much of the current stage is done, called on the loading thread
+    typedef std::function<void(qint64 done, qint64 total, const QString &stage)> ProgressCallback;
+    
+    virtual ~Loader() {}
+    
     virtual uint8_t *loadFile(const QString &filename) = 0;
     
     virtual void getDimensions(unsigned &width, unsigned &height, unsigned &depth, unsigned &bytesPerVal) const {
@@ -23,21 +35,112 @@ public:
         bytesPerVal = qCeil(bitDepth/8.);
     }
     
+    /// Distance between neighbouring voxels along each axis, the unit doesn't matter
+    QVector3D getSpacing() const {
+        return spacing;
+    }
+    
+    /**
+     * The values the window should span when the volume is shown, from the
+     * smallest to the largest one with linearize and the whole range of the
+     * bit depth otherwise. Floats have no such range, they always span their
+     * values. The data itself keeps its original values.
+     */
+    void getValueRange(float &min, float &max) const {
+        min = findsRange() ? valueMin : 0;
+        max = findsRange() ? valueMax : (1u << qMin(16u, bitDepth)) - 1;
+    }
+    
+    /// 32 bit values are floats, all others unsigned integers
+    static bool isFloat(unsigned bitDepth) {
+        return bitDepth == 32;
+    }
+    
+    /// How the buffer returned by the last loadFile call has to be released
+    BufferDeleter getDeleter() const {
+        return deleter;
+    }
+    
+    static void deleteArray(uint8_t *data) {
+        delete[] data;
+    }
+    
+    /// Why the last loadFile call returned nullptr
+    const QString &errorString() const {
+        return error;
+    }
+    
+    /// Describes the settings the loaded data depends on, cached volumes are only used if they match
+    virtual QString cacheKey() const {
+        return QString("linearize=%1").arg(int(linearize));
+    }
+    
+    /// The files other than filename the volume would be read from, the cache is only used while they are unchanged
+    virtual QStringList dataFiles(const QString &filename) const {
+        Q_UNUSED(filename);
+        return QStringList();
+    }
+    
     Loader &setLinearize(bool linearize) {
         this->linearize = linearize;
         return *this;
     }
     
+    bool getLinearize() const {
+        return linearize;
+    }
+    
+    Loader &setProgressCallback(ProgressCallback callback) {
+        this->progressCallback = callback;
+        return *this;
+    }
+    
+    /// Makes a running loadFile give up and return nullptr, may be called from any thread
+    void cancel() {
+        canceled = true;
+    }
+    
+    bool isCanceled() const {
+        return canceled;
+    }
+
 protected:
     
-    void findMinMax(int voxelCount, unsigned bytesPerValue, uint8_t *data, unsigned &min, unsigned &max);
-    inline unsigned scaleHistogram(unsigned val, unsigned min, unsigned max, unsigned rangeMax);
-    void normalizeData(int voxelCount, ByteOrder byteOrder, unsigned dstBytesPerVal, uint8_t *data, uint8_t *dst);
+    /// Reports progress, false if loading was canceled meanwhile
+    bool reportProgress(qint64 done, qint64 total, const QString &stage);
+    
+    /// Sets the error of a canceled load, returns what loadFile should return
+    std::nullptr_t canceledLoad();
+    
+    /// Whether the range of the values is needed, with linearize or for floats
+    bool findsRange() const {
+        return linearize || isFloat(bitDepth);
+    }
+    
+    /// Widens min and max to the values of data, floats are read as they are stored in byteOrder
+    void findMinMax(size_t voxelCount, ByteOrder byteOrder, unsigned bytesPerValue, const uint8_t *data, float &min, float &max);
+    
+    /// Converts the values to host byte order and dstBytesPerVal, floats stay floats. With findsRange their range is recorded as well
+    void normalizeData(size_t voxelCount, ByteOrder byteOrder, unsigned dstBytesPerVal, const uint8_t *data, uint8_t *dst);
+    void normalizeData(size_t voxelCount, ByteOrder byteOrder, unsigned dstBytesPerVal, const uint8_t *data, uint8_t *dst, float min, float max);
+    
+    void setValueRange(float min, float max) {
+        valueMin = min;
+        valueMax = max;
+    }
     
     unsigned width=0, height=0, depth=0;
+    QVector3D spacing = QVector3D(1, 1, 1);
+    
+    BufferDeleter deleter = deleteArray;
+    QString error;
     
     bool linearize = true;
     unsigned bitDepth;
+    float valueMin = 0, valueMax = 0;
+    
+    ProgressCallback progressCallback;
+    std::atomic<bool> canceled{false};
 };
 
 #endif // LOADER_H
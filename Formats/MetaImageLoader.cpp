@@ -0,0 +1,142 @@
+#include "MetaImageLoader.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QStringList>
+
+namespace {
+
+/// Reads the "Key = Value" lines up to ElementDataFile, which is always the last one
+QMap<QString, QString> readHeader(QFile &f)
+{
+    QMap<QString, QString> fields;
+    
+    while(!f.atEnd() && !fields.contains("elementdatafile")) {
+        QString line = QString::fromUtf8(f.readLine()).trimmed();
+        int equals = line.indexOf('=');
+        
+        if(equals > 0) {
+            fields[line.left(equals).trimmed().toLower()] = line.mid(equals+1).trimmed();
+        }
+    }
+    
+    return fields;
+}
+
+}
+
+QString MetaImageLoader::cacheKey() const
+{
+    return "mhd " + Loader::cacheKey();
+}
+
+QStringList MetaImageLoader::dataFiles(const QString &filename) const
+{
+    QFile f(filename);
+    
+    if(!f.open(QFile::ReadOnly)) {
+        return QStringList();
+    }
+    
+    // the data file is relative to the header, local and split data have none of their own
+    QString dataFile = readHeader(f).value("elementdatafile");
+    
+    if(dataFile.isEmpty() || dataFile.toUpper() == "LOCAL" || dataFile.startsWith("LIST") || dataFile.contains('%')) {
+        return QStringList();
+    }
+    
+    return QStringList(QFileInfo(filename).dir().filePath(dataFile));
+}
+
+uint8_t *MetaImageLoader::loadFile(const QString &filename)
+{
+    QFile f(filename);
+    
+    if(!f.open(QFile::ReadOnly)) {
+        error = QString("Could not open %1").arg(filename);
+        return nullptr;
+    }
+    
+    QMap<QString, QString> fields = readHeader(f);
+    
+    qint64 headerSize = f.pos();
+    f.close();
+    
+    if(!fields.contains("elementdatafile") || !fields.contains("dimsize")) {
+        error = QString("%1 is not a MetaImage header").arg(filename);
+        return nullptr;
+    }
+    
+    QStringList sizes = fields["dimsize"].split(' ', QString::SkipEmptyParts);
+    
+    if(sizes.size() != 3 || fields.value("ndims", "3").toInt() != 3) {
+        error = QString("Only 3D volumes are supported, %1 has %2 axes").arg(filename).arg(sizes.size());
+        return nullptr;
+    }
+    
+    if(fields.value("elementnumberofchannels", "1").toInt() != 1) {
+        error = QString("Only volumes with a single channel are supported");
+        return nullptr;
+    }
+    
+    unsigned width = sizes[0].toUInt(), height = sizes[1].toUInt(), depth = sizes[2].toUInt();
+    
+    static const QMap<QString, unsigned> elementBits = {
+        {"MET_UCHAR", 8}, {"MET_CHAR", 8}, {"MET_USHORT", 16}, {"MET_SHORT", 16}, {"MET_FLOAT", 32}
+    };
+    
+    QString elementType = fields["elementtype"].toUpper();
+    
+    if(!elementBits.contains(elementType)) {
+        error = QString("Elements of type %1 are not supported").arg(elementType);
+        return nullptr;
+    }
+    
+    unsigned bitDepth = elementBits[elementType];
+    bool compressed = fields.value("compresseddata").toLower() == "true";
+    
+    QString dataFile = fields["elementdatafile"];
+    qint64 dataOffset = 0;
+    
+    if(dataFile.toUpper() == "LOCAL") {
+        dataFile = filename;
+        dataOffset = headerSize;
+    } else if(dataFile.startsWith("LIST") || dataFile.contains('%')) {
+        error = QString("Data split across several files is not supported");
+        return nullptr;
+    } else {
+        // the data file is relative to the header
+        dataFile = QFileInfo(filename).dir().filePath(dataFile);
+    }
+    
+    qint64 bytesToRead = qint64(width)*height*depth*(bitDepth/8);
+    qint64 headerSkip = fields.value("headersize", "0").toLongLong();
+    
+    // -1 means the data is at the very end of the file
+    if(headerSkip == -1 && !compressed) {
+        dataOffset = QFileInfo(dataFile).size() - bytesToRead;
+    } else if(headerSkip > 0) {
+        dataOffset += headerSkip;
+    }
+    
+    // ElementSize is what older writers store instead of the spacing
+    QStringList spacings = fields.value("elementspacing", fields.value("elementsize")).split(' ', QString::SkipEmptyParts);
+    
+    for(int i=0; i<3 && i<spacings.size(); ++i) {
+        if(spacings[i].toDouble() > 0) {
+            spacing[i] = spacings[i].toDouble();
+        }
+    }
+    
+    // either key may carry the byte order
+    QString msb = fields.value("binarydatabyteordermsb", fields.value("elementbyteordermsb", "false")).toLower();
+    ByteOrder byteOrder = msb == "true" ? BO_BIG_ENDIAN : BO_LITTLE_ENDIAN;
+    
+    setDataOffset(dataOffset);
+    setCompressed(compressed);
+    setSigned(elementType == "MET_CHAR" || elementType == "MET_SHORT");
+    
+    return RawLoader::loadFile(dataFile, width, height, depth, byteOrder, bitDepth);
+}
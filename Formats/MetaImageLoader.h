@@ -0,0 +1,22 @@
+#ifndef METAIMAGELOADER_H
+#define METAIMAGELOADER_H
+
+#include "RawLoader.h"
+
+/**
+ * Loads MetaImage volumes, a .mhd header with a separate data file or a
+ * .mha file with the data right after the header (ElementDataFile = LOCAL).
+ *
+ * Like NrrdLoader it only reads the header and leaves the voxels to
+ * RawLoader. 8 and 16 bit integer and 32 bit float elements with a single
+ * channel are supported, compressed data is inflated while loading.
+ */
+class MetaImageLoader : public RawLoader
+{
+public:
+    uint8_t *loadFile(const QString &filename) override;
+    QString cacheKey() const override;
+    QStringList dataFiles(const QString &filename) const override;
+};
+
+#endif // METAIMAGELOADER_H
@@ -0,0 +1,433 @@
+#include "NormalizeKernels.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NORMALIZE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+
+template<unsigned BytesPerValue, bool BigEndian>
+inline unsigned readValue(const uint8_t *data, size_t i)
+{
+    if(BytesPerValue == 1) {
+        return data[i];
+    } else if(BigEndian) {
+        return data[i*2] <<8 | data[i*2+1];
+    } else {
+        return data[i*2] | data[i*2+1] <<8;
+    }
+}
+
+template<unsigned BytesPerValue, bool BigEndian>
+void minMaxScalar(const uint8_t *src, size_t count, unsigned &min, unsigned &max)
+{
+    unsigned lo = min, hi = max;
+    
+    for(size_t i=0; i<count; i++) {
+        unsigned val = readValue<BytesPerValue, BigEndian>(src, i);
+        
+        lo = std::min(lo, val);
+        hi = std::max(hi, val);
+    }
+    
+    min = lo;
+    max = hi;
+}
+
+template<unsigned BytesPerValue, bool BigEndian, typename Dst>
+void rescaleScalar(const uint8_t *src, size_t count, unsigned min, float scale, Dst *dst)
+{
+    const float dstMax = Dst(~0);
+    
+    for(size_t i=0; i<count; i++) {
+        int val = int(readValue<BytesPerValue, BigEndian>(src, i)) - int(min);
+        
+        dst[i] = Dst(std::min(std::max(0, val)*scale + .5f, dstMax));
+    }
+}
+
+void minMax8Scalar(const uint8_t *src, size_t count, unsigned &min, unsigned &max)
+{
+    minMaxScalar<1, false>(src, count, min, max);
+}
+
+void minMax16Scalar(const uint8_t *src, size_t count, bool bigEndian, unsigned &min, unsigned &max)
+{
+    if(bigEndian) {
+        minMaxScalar<2, true>(src, count, min, max);
+    } else {
+        minMaxScalar<2, false>(src, count, min, max);
+    }
+}
+
+void rescale8to8Scalar(const uint8_t *src, size_t count, unsigned min, float scale, uint8_t *dst)
+{
+    rescaleScalar<1, false>(src, count, min, scale, dst);
+}
+
+void rescale8to16Scalar(const uint8_t *src, size_t count, unsigned min, float scale, uint16_t *dst)
+{
+    rescaleScalar<1, false>(src, count, min, scale, dst);
+}
+
+void rescale16to8Scalar(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint8_t *dst)
+{
+    if(bigEndian) {
+        rescaleScalar<2, true>(src, count, min, scale, dst);
+    } else {
+        rescaleScalar<2, false>(src, count, min, scale, dst);
+    }
+}
+
+void rescale16to16Scalar(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint16_t *dst)
+{
+    if(bigEndian) {
+        rescaleScalar<2, true>(src, count, min, scale, dst);
+    } else {
+        rescaleScalar<2, false>(src, count, min, scale, dst);
+    }
+}
+
+const NormalizeKernels scalarKernels = {
+    "scalar",
+    minMax8Scalar,
+    minMax16Scalar,
+    rescale8to8Scalar,
+    rescale8to16Scalar,
+    rescale16to8Scalar,
+    rescale16to16Scalar
+};
+
+#ifdef NORMALIZE_X86_KERNELS
+
+/*
+ * SSE4.1
+ */
+
+#define SSE41 __attribute__((target("sse4.1")))
+
+SSE41 inline __m128i swapMaskSSE()
+{
+    return _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+}
+
+SSE41 inline __m128i load16SSE(const uint8_t *src, bool bigEndian)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)src);
+    
+    return bigEndian ? _mm_shuffle_epi8(v, swapMaskSSE()) : v;
+}
+
+/// rescales four 32 bit values
+SSE41 inline __m128i rescale4SSE(__m128i v, __m128i min, __m128 scale)
+{
+    v = _mm_max_epi32(_mm_sub_epi32(v, min), _mm_setzero_si128());
+    
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(v), scale), _mm_set1_ps(.5f)));
+}
+
+/// rescales eight 16 bit values
+SSE41 inline __m128i rescale8SSE(__m128i v, __m128i min, __m128 scale)
+{
+    __m128i lo = rescale4SSE(_mm_cvtepu16_epi32(v), min, scale);
+    __m128i hi = rescale4SSE(_mm_unpackhi_epi16(v, _mm_setzero_si128()), min, scale);
+    
+    return _mm_packus_epi32(lo, hi);
+}
+
+/// packs sixteen 16 bit values into bytes, saturating at 255
+SSE41 inline __m128i pack16to8SSE(__m128i lo, __m128i hi)
+{
+    const __m128i max = _mm_set1_epi16(255);
+    
+    return _mm_packus_epi16(_mm_min_epu16(lo, max), _mm_min_epu16(hi, max));
+}
+
+SSE41 inline unsigned hmin16SSE(__m128i v)
+{
+    return _mm_cvtsi128_si32(_mm_minpos_epu16(v)) & 0xffff;
+}
+
+SSE41 inline unsigned hmax16SSE(__m128i v)
+{
+    return ~_mm_cvtsi128_si32(_mm_minpos_epu16(_mm_xor_si128(v, _mm_set1_epi16(-1)))) & 0xffff;
+}
+
+SSE41 void minMax8SSE(const uint8_t *src, size_t count, unsigned &min, unsigned &max)
+{
+    __m128i lo = _mm_set1_epi8(-1), hi = _mm_setzero_si128();
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        
+        lo = _mm_min_epu8(lo, v);
+        hi = _mm_max_epu8(hi, v);
+    }
+    
+    // widen to 16 bit for the horizontal reduction
+    lo = _mm_min_epu16(_mm_cvtepu8_epi16(lo), _mm_unpackhi_epi8(lo, _mm_setzero_si128()));
+    hi = _mm_max_epu16(_mm_cvtepu8_epi16(hi), _mm_unpackhi_epi8(hi, _mm_setzero_si128()));
+    
+    if(i > 0) {
+        min = std::min(min, hmin16SSE(lo));
+        max = std::max(max, hmax16SSE(hi));
+    }
+    
+    minMaxScalar<1, false>(src+i, count-i, min, max);
+}
+
+SSE41 void minMax16SSE(const uint8_t *src, size_t count, bool bigEndian, unsigned &min, unsigned &max)
+{
+    __m128i lo = _mm_set1_epi16(-1), hi = _mm_setzero_si128();
+    size_t i = 0;
+    
+    for(; i+8<=count; i+=8) {
+        __m128i v = load16SSE(src+i*2, bigEndian);
+        
+        lo = _mm_min_epu16(lo, v);
+        hi = _mm_max_epu16(hi, v);
+    }
+    
+    if(i > 0) {
+        min = std::min(min, hmin16SSE(lo));
+        max = std::max(max, hmax16SSE(hi));
+    }
+    
+    minMax16Scalar(src+i*2, count-i, bigEndian, min, max);
+}
+
+SSE41 void rescale8to8SSE(const uint8_t *src, size_t count, unsigned min, float scale, uint8_t *dst)
+{
+    __m128i vmin = _mm_set1_epi32(min);
+    __m128 vscale = _mm_set1_ps(scale);
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+        
+        __m128i lo = rescale8SSE(_mm_cvtepu8_epi16(v), vmin, vscale);
+        __m128i hi = rescale8SSE(_mm_unpackhi_epi8(v, _mm_setzero_si128()), vmin, vscale);
+        
+        _mm_storeu_si128((__m128i*)(dst+i), pack16to8SSE(lo, hi));
+    }
+    
+    rescale8to8Scalar(src+i, count-i, min, scale, dst+i);
+}
+
+SSE41 void rescale16to8SSE(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint8_t *dst)
+{
+    __m128i vmin = _mm_set1_epi32(min);
+    __m128 vscale = _mm_set1_ps(scale);
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m128i lo = rescale8SSE(load16SSE(src+i*2, bigEndian), vmin, vscale);
+        __m128i hi = rescale8SSE(load16SSE(src+i*2+16, bigEndian), vmin, vscale);
+        
+        _mm_storeu_si128((__m128i*)(dst+i), pack16to8SSE(lo, hi));
+    }
+    
+    rescale16to8Scalar(src+i*2, count-i, bigEndian, min, scale, dst+i);
+}
+
+SSE41 void rescale16to16SSE(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint16_t *dst)
+{
+    __m128i vmin = _mm_set1_epi32(min);
+    __m128 vscale = _mm_set1_ps(scale);
+    size_t i = 0;
+    
+    for(; i+8<=count; i+=8) {
+        __m128i v = rescale8SSE(load16SSE(src+i*2, bigEndian), vmin, vscale);
+        
+        _mm_storeu_si128((__m128i*)(dst+i), v);
+    }
+    
+    rescale16to16Scalar(src+i*2, count-i, bigEndian, min, scale, dst+i);
+}
+
+const NormalizeKernels sse41Kernels = {
+    "sse4.1",
+    minMax8SSE,
+    minMax16SSE,
+    rescale8to8SSE,
+    rescale8to16Scalar,
+    rescale16to8SSE,
+    rescale16to16SSE
+};
+
+/*
+ * AVX2
+ */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 inline __m256i load16AVX(const uint8_t *src, bool bigEndian)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i*)src);
+    
+    if(bigEndian) {
+        const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                              1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+        v = _mm256_shuffle_epi8(v, mask);
+    }
+    
+    return v;
+}
+
+/// rescales eight 32 bit values
+AVX2 inline __m256i rescale8AVX(__m256i v, __m256i min, __m256 scale)
+{
+    v = _mm256_max_epi32(_mm256_sub_epi32(v, min), _mm256_setzero_si256());
+    
+    return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), scale), _mm256_set1_ps(.5f)));
+}
+
+/// rescales sixteen 16 bit values, the result keeps their order
+AVX2 inline __m256i rescale16AVX(__m256i v, __m256i min, __m256 scale)
+{
+    __m256i lo = rescale8AVX(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)), min, scale);
+    __m256i hi = rescale8AVX(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)), min, scale);
+    
+    // packus works per 128 bit lane, put the quadwords back in order
+    return _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8);
+}
+
+AVX2 inline __m128i pack16to8AVX(__m256i v)
+{
+    return pack16to8SSE(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+AVX2 void minMax8AVX(const uint8_t *src, size_t count, unsigned &min, unsigned &max)
+{
+    __m256i lo = _mm256_set1_epi8(-1), hi = _mm256_setzero_si256();
+    size_t i = 0;
+    
+    for(; i+32<=count; i+=32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src+i));
+        
+        lo = _mm256_min_epu8(lo, v);
+        hi = _mm256_max_epu8(hi, v);
+    }
+    
+    if(i > 0) {
+        __m128i lo8 = _mm_min_epu8(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1));
+        __m128i hi8 = _mm_max_epu8(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1));
+        
+        min = std::min(min, hmin16SSE(_mm_min_epu16(_mm_cvtepu8_epi16(lo8), _mm_unpackhi_epi8(lo8, _mm_setzero_si128()))));
+        max = std::max(max, hmax16SSE(_mm_max_epu16(_mm_cvtepu8_epi16(hi8), _mm_unpackhi_epi8(hi8, _mm_setzero_si128()))));
+    }
+    
+    minMaxScalar<1, false>(src+i, count-i, min, max);
+}
+
+AVX2 void minMax16AVX(const uint8_t *src, size_t count, bool bigEndian, unsigned &min, unsigned &max)
+{
+    __m256i lo = _mm256_set1_epi16(-1), hi = _mm256_setzero_si256();
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m256i v = load16AVX(src+i*2, bigEndian);
+        
+        lo = _mm256_min_epu16(lo, v);
+        hi = _mm256_max_epu16(hi, v);
+    }
+    
+    if(i > 0) {
+        min = std::min(min, hmin16SSE(_mm_min_epu16(_mm256_castsi256_si128(lo), _mm256_extracti128_si256(lo, 1))));
+        max = std::max(max, hmax16SSE(_mm_max_epu16(_mm256_castsi256_si128(hi), _mm256_extracti128_si256(hi, 1))));
+    }
+    
+    minMax16Scalar(src+i*2, count-i, bigEndian, min, max);
+}
+
+AVX2 void rescale8to8AVX(const uint8_t *src, size_t count, unsigned min, float scale, uint8_t *dst)
+{
+    __m256i vmin = _mm256_set1_epi32(min);
+    __m256 vscale = _mm256_set1_ps(scale);
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m256i v = rescale16AVX(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src+i))), vmin, vscale);
+        
+        _mm_storeu_si128((__m128i*)(dst+i), pack16to8AVX(v));
+    }
+    
+    rescale8to8Scalar(src+i, count-i, min, scale, dst+i);
+}
+
+AVX2 void rescale16to8AVX(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint8_t *dst)
+{
+    __m256i vmin = _mm256_set1_epi32(min);
+    __m256 vscale = _mm256_set1_ps(scale);
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m256i v = rescale16AVX(load16AVX(src+i*2, bigEndian), vmin, vscale);
+        
+        _mm_storeu_si128((__m128i*)(dst+i), pack16to8AVX(v));
+    }
+    
+    rescale16to8Scalar(src+i*2, count-i, bigEndian, min, scale, dst+i);
+}
+
+AVX2 void rescale16to16AVX(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint16_t *dst)
+{
+    __m256i vmin = _mm256_set1_epi32(min);
+    __m256 vscale = _mm256_set1_ps(scale);
+    size_t i = 0;
+    
+    for(; i+16<=count; i+=16) {
+        __m256i v = rescale16AVX(load16AVX(src+i*2, bigEndian), vmin, vscale);
+        
+        _mm256_storeu_si256((__m256i*)(dst+i), v);
+    }
+    
+    rescale16to16Scalar(src+i*2, count-i, bigEndian, min, scale, dst+i);
+}
+
+const NormalizeKernels avx2Kernels = {
+    "avx2",
+    minMax8AVX,
+    minMax16AVX,
+    rescale8to8AVX,
+    rescale8to16Scalar,
+    rescale16to8AVX,
+    rescale16to16AVX
+};
+
+#endif // NORMALIZE_X86_KERNELS
+
+const NormalizeKernels &selectKernels()
+{
+#ifdef NORMALIZE_X86_KERNELS
+    __builtin_cpu_init();
+    
+    if(__builtin_cpu_supports("avx2")) {
+        return avx2Kernels;
+    }
+    
+    if(__builtin_cpu_supports("sse4.1")) {
+        return sse41Kernels;
+    }
+#endif
+    
+    return scalarKernels;
+}
+
+}
+
+const NormalizeKernels &normalizeKernels()
+{
+    static const NormalizeKernels &kernels = selectKernels();
+    
+    return kernels;
+}
+
+const NormalizeKernels &scalarNormalizeKernels()
+{
+    return scalarKernels;
+}
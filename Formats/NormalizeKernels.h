@@ -0,0 +1,32 @@
+#ifndef NORMALIZEKERNELS_H
+#define NORMALIZEKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Inner loops of Loader::normalizeData. 16 bit sources are read byte-wise
+ * and don't have to be aligned, bigEndian selects how their bytes are
+ * combined. Rescaling computes (val-min)*scale rounded to the nearest
+ * integer and saturated to the destination type. src and dst may be
+ * the same buffer as long as both have the same value size.
+ */
+struct NormalizeKernels {
+    const char *name;
+    
+    void (*minMax8)(const uint8_t *src, size_t count, unsigned &min, unsigned &max);
+    void (*minMax16)(const uint8_t *src, size_t count, bool bigEndian, unsigned &min, unsigned &max);
+    
+    void (*rescale8to8)(const uint8_t *src, size_t count, unsigned min, float scale, uint8_t *dst);
+    void (*rescale8to16)(const uint8_t *src, size_t count, unsigned min, float scale, uint16_t *dst);
+    void (*rescale16to8)(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint8_t *dst);
+    void (*rescale16to16)(const uint8_t *src, size_t count, bool bigEndian, unsigned min, float scale, uint16_t *dst);
+};
+
+/// The fastest kernels the cpu supports, chosen once at runtime
+const NormalizeKernels &normalizeKernels();
+
+/// The plain C++ kernels, available everywhere
+const NormalizeKernels &scalarNormalizeKernels();
+
+#endif // NORMALIZEKERNELS_H
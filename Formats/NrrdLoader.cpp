@@ -0,0 +1,233 @@
+#include "NrrdLoader.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QList>
+#include <QMap>
+#include <QStringList>
+
+#include <cmath>
+
+namespace {
+
+/// Bits and signedness of the NRRD types that can be loaded, false for all others. Floats have 32 bits
+bool parseType(const QString &type, unsigned &bitDepth, bool &signedValues)
+{
+    static const QStringList uint8Types = {"uchar", "unsigned char", "uint8", "uint8_t"};
+    static const QStringList int8Types = {"signed char", "int8", "int8_t"};
+    static const QStringList uint16Types = {"ushort", "unsigned short", "unsigned short int", "uint16", "uint16_t"};
+    static const QStringList int16Types = {"short", "short int", "signed short", "signed short int", "int16", "int16_t"};
+    
+    if(type == "float") {
+        bitDepth = 32;
+        signedValues = false;
+        return true;
+    }
+    
+    bitDepth = (uint8Types.contains(type) || int8Types.contains(type)) ? 8 : 16;
+    signedValues = int8Types.contains(type) || int16Types.contains(type);
+    
+    return uint8Types.contains(type) || int8Types.contains(type) || uint16Types.contains(type) || int16Types.contains(type);
+}
+
+/// Spacing along the spatial axes, which are the last three, from the "space directions" or the "spacings"
+QVector3D parseSpacing(const QMap<QString, QString> &fields)
+{
+    QList<double> spacings;
+    
+    if(fields.contains("space directions")) {
+        // one "(x,y,z)" vector per spatial axis, "none" for the others
+        const QString &directions = fields["space directions"];
+        
+        for(int open = directions.indexOf('('); open >= 0; open = directions.indexOf('(', open+1)) {
+            int close = directions.indexOf(')', open);
+            double length = 0;
+            
+            for(const QString &component : directions.mid(open+1, close-open-1).split(',')) {
+                length += component.toDouble()*component.toDouble();
+            }
+            
+            spacings << std::sqrt(length);
+        }
+    } else {
+        for(const QString &spacing : fields["spacings"].split(' ', QString::SkipEmptyParts)) {
+            spacings << spacing.toDouble();
+        }
+    }
+    
+    QVector3D spacing(1, 1, 1);
+    int first = qMax(0, spacings.size()-3);
+    
+    for(int i=0; i<3 && first+i<spacings.size(); ++i) {
+        double value = spacings[first+i];
+        
+        // unknown spacings are nan
+        if(value > 0) {
+            spacing[i] = value;
+        }
+    }
+    
+    return spacing;
+}
+
+/// Reads the fields of the header up to the data, false if f is not a NRRD file
+bool readHeader(QFile &f, QMap<QString, QString> &fields)
+{
+    if(!f.readLine().startsWith("NRRD")) {
+        return false;
+    }
+    
+    // the header ends with an empty line, or the end of a detached header
+    while(!f.atEnd()) {
+        QString line = QString::fromUtf8(f.readLine()).trimmed();
+        
+        if(line.isEmpty()) {
+            break;
+        }
+        
+        int colon = line.indexOf(": ");
+        int keyValue = line.indexOf(":=");
+        
+        // skip comments and key/value pairs, which are free text
+        if(line.startsWith('#') || colon < 0 || (keyValue >= 0 && keyValue < colon)) {
+            continue;
+        }
+        
+        fields[line.left(colon).toLower()] = line.mid(colon+2).trimmed();
+    }
+    
+    return true;
+}
+
+}
+
+QString NrrdLoader::cacheKey() const
+{
+    return "nrrd " + Loader::cacheKey();
+}
+
+QStringList NrrdLoader::dataFiles(const QString &filename) const
+{
+    QFile f(filename);
+    QMap<QString, QString> fields;
+    
+    if(!f.open(QFile::ReadOnly) || !readHeader(f, fields)) {
+        return QStringList();
+    }
+    
+    // detached data is relative to the header, split data isn't loaded at all
+    QString dataFile = fields.value("data file", fields.value("datafile"));
+    
+    if(dataFile.isEmpty() || dataFile.startsWith("LIST") || dataFile.contains('%')) {
+        return QStringList();
+    }
+    
+    return QStringList(QFileInfo(filename).dir().filePath(dataFile));
+}
+
+uint8_t *NrrdLoader::loadFile(const QString &filename)
+{
+    QFile f(filename);
+    
+    if(!f.open(QFile::ReadOnly)) {
+        error = QString("Could not open %1").arg(filename);
+        return nullptr;
+    }
+    
+    QMap<QString, QString> fields;
+    
+    if(!readHeader(f, fields)) {
+        error = QString("%1 is not a NRRD file").arg(filename);
+        return nullptr;
+    }
+    
+    qint64 headerSize = f.pos();
+    f.close();
+    
+    QStringList sizes = fields["sizes"].split(' ', QString::SkipEmptyParts);
+    
+    // a single leading component axis is as good as none
+    if(sizes.size() == 4 && sizes[0].toUInt() == 1) {
+        sizes.removeFirst();
+    }
+    
+    if(sizes.size() != 3) {
+        error = QString("Only 3D volumes are supported, %1 has %2 axes").arg(filename).arg(sizes.size());
+        return nullptr;
+    }
+    
+    unsigned width = sizes[0].toUInt(), height = sizes[1].toUInt(), depth = sizes[2].toUInt();
+    
+    unsigned bitDepth;
+    bool signedValues;
+    
+    if(!parseType(fields["type"], bitDepth, signedValues)) {
+        error = QString("Values of type \"%1\" are not supported").arg(fields["type"]);
+        return nullptr;
+    }
+    
+    QString encoding = fields.value("encoding", "raw");
+    
+    if(encoding != "raw" && encoding != "gzip" && encoding != "gz") {
+        error = QString("The %1 encoding is not supported").arg(encoding);
+        return nullptr;
+    }
+    
+    QString dataFile = fields.value("data file", fields.value("datafile"));
+    qint64 dataOffset = headerSize;
+    
+    if(!dataFile.isEmpty()) {
+        if(dataFile.startsWith("LIST") || dataFile.contains('%')) {
+            error = QString("Data split across several files is not supported");
+            return nullptr;
+        }
+        
+        // detached data is relative to the header
+        dataFile = QFileInfo(filename).dir().filePath(dataFile);
+        dataOffset = 0;
+    } else {
+        dataFile = filename;
+    }
+    
+    qint64 bytesToRead = qint64(width)*height*depth*(bitDepth/8);
+    int lineSkip = fields.value("line skip", fields.value("lineskip", "0")).toInt();
+    int byteSkip = fields.value("byte skip", fields.value("byteskip", "0")).toInt();
+    
+    if(lineSkip > 0) {
+        QFile data(dataFile);
+        
+        if(!data.open(QFile::ReadOnly) || !data.seek(dataOffset)) {
+            error = QString("Could not open %1").arg(dataFile);
+            return nullptr;
+        }
+        
+        for(int i=0; i<lineSkip; ++i) {
+            data.readLine();
+        }
+        
+        dataOffset = data.pos();
+    }
+    
+    if(byteSkip != 0 && encoding != "raw") {
+        error = QString("Skipping bytes of compressed data is not supported");
+        return nullptr;
+    }
+    
+    // -1 means the data is at the very end of the file
+    if(byteSkip == -1) {
+        dataOffset = QFileInfo(dataFile).size() - bytesToRead;
+    } else {
+        dataOffset += byteSkip;
+    }
+    
+    spacing = parseSpacing(fields);
+    
+    setDataOffset(dataOffset);
+    setCompressed(encoding != "raw");
+    setSigned(signedValues);
+    
+    ByteOrder byteOrder = fields["endian"] == "big" ? BO_BIG_ENDIAN : BO_LITTLE_ENDIAN;
+    
+    return RawLoader::loadFile(dataFile, width, height, depth, byteOrder, bitDepth);
+}
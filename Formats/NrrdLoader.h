@@ -0,0 +1,23 @@
+#ifndef NRRDLOADER_H
+#define NRRDLOADER_H
+
+#include "RawLoader.h"
+
+/**
+ * Loads NRRD volumes, with attached data (.nrrd) or detached (.nhdr).
+ *
+ * The header tells sizes, type, endianness, encoding and spacing, the
+ * voxels are read by RawLoader from where they start, so raw data is
+ * mapped without copying and gzip data is inflated while loading.
+ * 8 and 16 bit integer types and 32 bit float with raw or gzip encoding
+ * are supported.
+ */
+class NrrdLoader : public RawLoader
+{
+public:
+    uint8_t *loadFile(const QString &filename) override;
+    QString cacheKey() const override;
+    QStringList dataFiles(const QString &filename) const override;
+};
+
+#endif // NRRDLOADER_H
@@ -1,10 +1,64 @@
 #include "Formats/RawLoader.h"
 
 #include <QFile>
+#include <QFileInfo>
 #include <QVector3D>
 #include <QDebug>
+#include <QSemaphore>
+#include <QSysInfo>
+#include <QtConcurrent>
+
+#include <cstring>
+#include <limits>
+#include <memory>
 
 #include <qmath.h>
+#include <zlib.h>
+
+#include "common.h"
+
+namespace {
+
+/// gzip and zlib streams are recognized by their suffix or the gzip magic number,
+/// a file of exactly the size of the volume is always taken as raw data
+bool isCompressed(const QString &filename, qint64 dataOffset, qint64 bytesToRead)
+{
+    QFile f(filename);
+    
+    if(!f.open(QFile::ReadOnly) || f.size() == dataOffset + bytesToRead) {
+        return false;
+    }
+    
+    QString suffix = QFileInfo(filename).suffix().toLower();
+    
+    if(suffix == "gz" || suffix == "z" || suffix == "zlib") {
+        return true;
+    }
+    
+    // further in, the magic number could just as well be voxels, formats with a header say what they store
+    if(dataOffset > 0) {
+        return false;
+    }
+    
+    QByteArray magic = f.peek(2);
+    
+    return magic.size() == 2 && uint8_t(magic[0]) == 0x1f && uint8_t(magic[1]) == 0x8b;
+}
+
+/// Moves two's complement values onto the unsigned range by flipping their sign bit, which keeps their order
+void flipSignBits(uint8_t *data, qint64 bytes, unsigned bytesPerValue, Loader::ByteOrder byteOrder)
+{
+    // the sign bit is in the most significant byte
+    const unsigned msb = (bytesPerValue == 2 && byteOrder == Loader::BO_LITTLE_ENDIAN) ? 1 : 0;
+    
+    parallelFor(bytes/bytesPerValue, [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; ++i) {
+            data[i*bytesPerValue + msb] ^= 0x80;
+        }
+    });
+}
+
+}
 
 uint8_t *RawLoader::loadFile(const QString &filename)
 {
@@ -13,31 +67,451 @@ uint8_t *RawLoader::loadFile(const QString &filename)
 
 uint8_t *RawLoader::loadFile(const QString &filename, int width, int height, int depth, ByteOrder byteOrder, short bitDepth)
 {
-    QFile f(filename);
-    
     this->width = width;
     this->height = height;
     this->depth = depth;
     this->bitDepth = bitDepth;
+    this->byteOrder = byteOrder;
+    
+    // the destination belongs to whoever set it
+    deleter = destination != nullptr ? BufferDeleter([](uint8_t *) {}) : BufferDeleter(deleteArray);
     
     int bytesPerValue = qCeil(bitDepth/8.);
     
-    int voxelCount = width*height*depth;
-    int bytesToRead = voxelCount*bytesPerValue;
+    size_t voxelCount = size_t(width)*height*depth;
+    qint64 bytesToRead = qint64(voxelCount)*bytesPerValue;
+    
+    // compressed files can neither be mapped nor read as they are
+    if(compressed || isCompressed(filename, dataOffset, bytesToRead)) {
+        if(hasRegion()) {
+            error = QString("Regions of compressed files can't be loaded");
+            return nullptr;
+        }
+        
+        return loadCompressed(filename, bytesToRead);
+    }
+    
+    if(hasRegion()) {
+        return loadRegion(filename);
+    }
+    
+    if(ioMode == IOMode::IO_MMAP) {
+        uint8_t *data = loadMapped(filename, voxelCount, bytesToRead);
+        
+        if(data != nullptr) {
+            return data;
+        }
+        
+        // the file could not be mapped, fall back to reading it
+    } else if(ioMode == IOMode::IO_STREAM) {
+        return loadStreamed(filename, bytesToRead);
+    }
     
-    uint8_t *raw = new uint8_t[bytesToRead];
-    uint8_t *dst = new uint8_t[bytesToRead];
+    QFile f(filename);
     
-    if(f.exists() && f.open(QFile::ReadOnly)) {
-        f.read((char*)raw, bytesToRead);
+    if(f.exists() && f.open(QFile::ReadOnly) && f.seek(dataOffset)) {
+        uint8_t *raw = allocate(bytesToRead);
+        
+        // read slab by slab, so progress can be shown and the load canceled
+        for(qint64 offset=0; offset<bytesToRead; offset+=slabSize) {
+            if(!reportProgress(offset, bytesToRead, "Reading")) {
+                release(raw);
+                return canceledLoad();
+            }
+            
+            f.read((char*)raw + offset, qMin<qint64>(slabSize, bytesToRead-offset));
+        }
         
         f.close();
         
-        normalizeData(voxelCount, byteOrder, bytesPerValue, raw, dst);
-        delete[] raw;
+        if(!reportProgress(0, 1, "Normalizing")) {
+            release(raw);
+            return canceledLoad();
+        }
         
-        return dst;
+        if(signedValues) {
+            flipSignBits(raw, bytesToRead, bytesPerValue, byteOrder);
+        }
+        
+        normalizeData(voxelCount, byteOrder, bytesPerValue, raw, raw);
+        
+        return raw;
     }
     
+    error = QString("Could not open %1").arg(filename);
     return nullptr;
 }
+
+void RawLoader::getDimensions(unsigned &width, unsigned &height, unsigned &depth, unsigned &bytesPerVal) const
+{
+    regionSize(width, height, depth);
+    
+    width = (width + strideX-1)/strideX;
+    height = (height + strideY-1)/strideY;
+    depth = (depth + strideZ-1)/strideZ;
+    
+    bytesPerVal = qCeil(bitDepth/8.);
+}
+
+QString RawLoader::cacheKey() const
+{
+    QString key = QString("raw %1x%2x%3 bits=%4 order=%5 ").arg(width).arg(height).arg(depth).arg(bitDepth).arg(byteOrder);
+    
+    if(hasRegion()) {
+        key += QString("region=%1,%2,%3+%4x%5x%6 ").arg(regionX).arg(regionY).arg(regionZ).arg(regionWidth).arg(regionHeight).arg(regionDepth);
+        key += QString("stride=%1,%2,%3 ").arg(strideX).arg(strideY).arg(strideZ);
+    }
+    
+    return key + Loader::cacheKey();
+}
+
+void RawLoader::regionSize(unsigned &width, unsigned &height, unsigned &depth) const
+{
+    width = this->width > regionX ? this->width - regionX : 0;
+    height = this->height > regionY ? this->height - regionY : 0;
+    depth = this->depth > regionZ ? this->depth - regionZ : 0;
+    
+    if(regionWidth > 0) {
+        width = qMin(width, regionWidth);
+    }
+    
+    if(regionHeight > 0) {
+        height = qMin(height, regionHeight);
+    }
+    
+    if(regionDepth > 0) {
+        depth = qMin(depth, regionDepth);
+    }
+}
+
+uint8_t *RawLoader::loadRegion(const QString &filename)
+{
+    unsigned bytesPerValue;
+    unsigned outWidth, outHeight, outDepth;
+    getDimensions(outWidth, outHeight, outDepth, bytesPerValue);
+    
+    if(outWidth == 0 || outHeight == 0 || outDepth == 0) {
+        error = QString("The region lies outside of the %1x%2x%3 volume").arg(width).arg(height).arg(depth);
+        return nullptr;
+    }
+    
+    const qint64 rowBytes = qint64(width)*bytesPerValue;
+    const qint64 sliceBytes = rowBytes*height;
+    const qint64 outRowBytes = qint64(outWidth)*bytesPerValue;
+    const qint64 outSliceBytes = outRowBytes*outHeight;
+    
+    // the span of a file row that holds the voxels of an output row
+    const qint64 spanBytes = (qint64(outWidth-1)*strideX + 1)*bytesPerValue;
+    
+    // without gaps between the rows a slice of the region is a single read
+    const bool wholeRows = regionX == 0 && outWidth == width && strideX == 1 && strideY == 1;
+    
+    uint8_t *dst = allocate(outSliceBytes*outDepth);
+    
+    std::atomic<unsigned> slicesRead{0};
+    std::atomic<bool> openFailed{false};
+    
+    // every thread reads its slices with its own file
+    parallelFor(outDepth, [&](size_t begin, size_t end) {
+        QFile f(filename);
+        
+        if(!f.open(QFile::ReadOnly)) {
+            openFailed = true;
+            return;
+        }
+        
+        QByteArray span(strideX > 1 ? spanBytes : 0, Qt::Uninitialized);
+        
+        for(size_t k=begin; k<end && !canceled; ++k) {
+            const qint64 slice = dataOffset + (regionZ + qint64(k)*strideZ)*sliceBytes;
+            uint8_t *out = dst + k*outSliceBytes;
+            
+            if(wholeRows) {
+                f.seek(slice + regionY*rowBytes);
+                qint64 read = qMax<qint64>(0, f.read((char*)out, outSliceBytes));
+                
+                memset(out + read, 0, outSliceBytes - read);
+            } else {
+                for(unsigned j=0; j<outHeight; ++j, out+=outRowBytes) {
+                    f.seek(slice + (regionY + qint64(j)*strideY)*rowBytes + regionX*bytesPerValue);
+                    
+                    if(strideX == 1) {
+                        qint64 read = qMax<qint64>(0, f.read((char*)out, outRowBytes));
+                        memset(out + read, 0, outRowBytes - read);
+                        continue;
+                    }
+                    
+                    qint64 read = qMax<qint64>(0, f.read(span.data(), spanBytes));
+                    memset(span.data() + read, 0, spanBytes - read);
+                    
+                    for(unsigned i=0; i<outWidth; ++i) {
+                        memcpy(out + i*bytesPerValue, span.constData() + qint64(i)*strideX*bytesPerValue, bytesPerValue);
+                    }
+                }
+            }
+            
+            reportProgress(++slicesRead, outDepth, "Reading");
+        }
+    }, 1);
+    
+    if(openFailed) {
+        release(dst);
+        error = QString("Could not open %1").arg(filename);
+        return nullptr;
+    }
+    
+    if(canceled || !reportProgress(0, 1, "Normalizing")) {
+        release(dst);
+        return canceledLoad();
+    }
+    
+    if(signedValues) {
+        flipSignBits(dst, outSliceBytes*outDepth, bytesPerValue, byteOrder);
+    }
+    
+    normalizeData(size_t(outWidth)*outHeight*outDepth, byteOrder, bytesPerValue, dst, dst);
+    
+    // the voxels are further apart by the strides
+    spacing *= QVector3D(strideX, strideY, strideZ);
+    
+    return dst;
+}
+
+uint8_t *RawLoader::loadMapped(const QString &filename, size_t voxelCount, qint64 bytesToRead)
+{
+    // shared so that a buffer handed out directly from the mapping keeps the file open
+    std::shared_ptr<QFile> f = std::make_shared<QFile>(filename);
+    
+    if(!f->open(QFile::ReadOnly) || f->size() < dataOffset + bytesToRead) {
+        return nullptr;
+    }
+    
+    uint8_t *mapped = f->map(dataOffset, bytesToRead);
+    
+    if(mapped == nullptr) {
+        return nullptr;
+    }
+    
+    int bytesPerValue = qCeil(bitDepth/8.);
+    
+    // the actual reading happens while normalizing, on page faults
+    if(!reportProgress(0, 1, "Normalizing")) {
+        f->unmap(mapped);
+        return canceledLoad();
+    }
+    
+    if(signedValues) {
+        // the mapping is read only, the sign bits are flipped in the copy
+        uint8_t *dst = allocate(bytesToRead);
+        
+        memcpy(dst, mapped, bytesToRead);
+        f->unmap(mapped);
+        
+        flipSignBits(dst, bytesToRead, bytesPerValue, byteOrder);
+        normalizeData(voxelCount, byteOrder, bytesPerValue, dst, dst);
+        
+        return dst;
+    }
+    
+    float min = std::numeric_limits<float>::max(), max = std::numeric_limits<float>::lowest();
+    
+    if(findsRange()) {
+        findMinMax(voxelCount, byteOrder, bytesPerValue, mapped, min, max);
+    }
+    
+    const Loader::ByteOrder hostOrder = QSysInfo::ByteOrder == QSysInfo::LittleEndian ? BO_LITTLE_ENDIAN : BO_BIG_ENDIAN;
+    const bool usable = bytesPerValue == 1 || (byteOrder == hostOrder && dataOffset % bytesPerValue == 0);
+    
+    if(usable) {
+        // the values are kept as they are, Volume can read straight from the mapping
+        setValueRange(min, max);
+        
+        if(destination != nullptr) {
+            memcpy(destination, mapped, bytesToRead);
+            f->unmap(mapped);
+            return destination;
+        }
+        
+        deleter = [f](uint8_t *data) {
+            f->unmap(data);
+        };
+        
+        return mapped;
+    }
+    
+    uint8_t *dst = allocate(bytesToRead);
+    
+    normalizeData(voxelCount, byteOrder, bytesPerValue, mapped, dst, min, max);
+    
+    f->unmap(mapped);
+    
+    return dst;
+}
+
+uint8_t *RawLoader::loadStreamed(const QString &filename, qint64 bytesToRead)
+{
+    QFile f(filename);
+    
+    if(!f.open(QFile::ReadOnly) || !f.seek(dataOffset)) {
+        error = QString("Could not open %1").arg(filename);
+        return nullptr;
+    }
+    
+    return loadStreamed([&f](uint8_t *data, qint64 bytes) {
+        return qMax<qint64>(0, f.read((char*)data, bytes));
+    }, bytesToRead);
+}
+
+uint8_t *RawLoader::loadCompressed(const QString &filename, qint64 bytesToRead)
+{
+    QFile f(filename);
+    
+    if(!f.open(QFile::ReadOnly) || !f.seek(dataOffset)) {
+        error = QString("Could not open %1").arg(filename);
+        return nullptr;
+    }
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    
+    // +32 lets zlib tell gzip and zlib headers apart by itself
+    if(inflateInit2(&stream, 15+32) != Z_OK) {
+        error = QString("Could not initialize zlib");
+        return nullptr;
+    }
+    
+    QByteArray input(256*1024, Qt::Uninitialized);
+    bool streamEnded = false;
+    
+    // inflated on the reader thread straight into the slabs, which are normalized meanwhile
+    uint8_t *volume = loadStreamed([&](uint8_t *data, qint64 bytes) -> qint64 {
+        qint64 done = 0;
+        
+        while(done < bytes && !streamEnded) {
+            if(stream.avail_in == 0) {
+                qint64 read = f.read(input.data(), input.size());
+                
+                if(read <= 0) {
+                    // truncated, the rest is filled with zeros like for raw files
+                    break;
+                }
+                
+                stream.next_in = (Bytef*)input.data();
+                stream.avail_in = read;
+            }
+            
+            // avail_out is 32 bit, huge slabs are inflated in several steps
+            uInt chunk = qMin<qint64>(bytes-done, 1 << 30);
+            
+            stream.next_out = data + done;
+            stream.avail_out = chunk;
+            
+            int result = inflate(&stream, Z_NO_FLUSH);
+            done += chunk - stream.avail_out;
+            
+            if(result == Z_STREAM_END) {
+                // concatenated gzip members continue the volume
+                if(stream.avail_in > 0 || !f.atEnd()) {
+                    inflateReset(&stream);
+                } else {
+                    streamEnded = true;
+                }
+            } else if(result != Z_OK && result != Z_BUF_ERROR) {
+                error = QString("Could not decompress %1: %2").arg(filename).arg(stream.msg ? stream.msg : "invalid data");
+                return -1;
+            }
+        }
+        
+        return done;
+    }, bytesToRead);
+    
+    inflateEnd(&stream);
+    
+    return volume;
+}
+
+uint8_t *RawLoader::loadStreamed(const StreamReader &read, qint64 bytesToRead)
+{
+    int bytesPerValue = qCeil(bitDepth/8.);
+    
+    qint64 sliceBytes = qint64(width)*height*bytesPerValue;
+    unsigned slabDepth = qBound<qint64>(1, slabSize/sliceBytes, depth);
+    unsigned slabCount = (depth + slabDepth-1)/slabDepth;
+    
+    // slabs are read straight into the destination and normalized in place,
+    // so there is never more than one copy of the volume in memory
+    uint8_t *dst = allocate(bytesToRead);
+    
+    QSemaphore slabsRead;
+    std::atomic<bool> readFailed{false};
+    
+    QFuture<void> reader = QtConcurrent::run([&]() {
+        for(unsigned slab=0; slab<slabCount; ++slab) {
+            if(canceled || readFailed) {
+                // don't leave the consumer waiting for the remaining slabs
+                slabsRead.release(slabCount - slab);
+                break;
+            }
+            
+            qint64 offset = qint64(slab)*slabDepth*sliceBytes;
+            qint64 bytes = qMin<qint64>(slabDepth*sliceBytes, bytesToRead-offset);
+            
+            qint64 bytesRead = read(dst + offset, bytes);
+            
+            if(bytesRead < 0) {
+                readFailed = true;
+                bytesRead = 0;
+            }
+            
+            if(bytesRead < bytes) {
+                memset(dst + offset + bytesRead, 0, bytes - bytesRead);
+            }
+            
+            if(signedValues) {
+                flipSignBits(dst + offset, bytes, bytesPerValue, byteOrder);
+            }
+            
+            slabsRead.release();
+        }
+    });
+    
+    float min = std::numeric_limits<float>::max(), max = std::numeric_limits<float>::lowest();
+    
+    // normalize slab n while the reader fetches slab n+1, the values don't
+    // depend on the range, so every slab is final right away
+    for(unsigned slab=0; slab<slabCount; ++slab) {
+        slabsRead.acquire();
+        
+        if(readFailed || !reportProgress(qint64(slab)*slabDepth*sliceBytes, bytesToRead, "Reading")) {
+            continue;
+        }
+        
+        unsigned z = slab*slabDepth;
+        unsigned slices = qMin(slabDepth, depth-z);
+        uint8_t *data = dst + z*sliceBytes;
+        
+        if(findsRange()) {
+            findMinMax(size_t(width)*height*slices, byteOrder, bytesPerValue, data, min, max);
+        }
+        
+        normalizeData(size_t(width)*height*slices, byteOrder, bytesPerValue, data, data, min, max);
+        
+        if(slabCallback) {
+            slabCallback(z, slices, data);
+        }
+    }
+    
+    reader.waitForFinished();
+    
+    if(canceled) {
+        release(dst);
+        return canceledLoad();
+    }
+    
+    if(readFailed) {
+        release(dst);
+        return nullptr;
+    }
+    
+    return dst;
+}
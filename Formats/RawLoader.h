@@ -5,13 +5,28 @@
 
 #include <QString>
 #include <cstdint>
+#include <functional>
 
 class RawLoader : public Loader
 {
 public:
+    enum IOMode {
+        IO_READ = 0,
+        IO_MMAP = 1,
+        IO_STREAM = 2
+    };
+    
+    /// Receives each normalized slab of depth slices starting at slice z while streaming
+    typedef std::function<void(unsigned z, unsigned depth, const uint8_t *data)> SlabCallback;
+    
     uint8_t *loadFile(const QString &filename) override;
     uint8_t *loadFile(const QString &filename, int width, int height, int depth, ByteOrder byteOrder=BO_LITTLE_ENDIAN, short bitDepth=8);
     
+    /// The size of what is loaded, which is smaller than the file with a region or strides
+    void getDimensions(unsigned &width, unsigned &height, unsigned &depth, unsigned &bytesPerVal) const override;
+    
+    QString cacheKey() const override;
+    
     RawLoader &setWidth(int width) {
         this->width = width;
         return *this;
@@ -37,6 +52,70 @@ public:
         return *this;
     }
     
+    RawLoader &setIOMode(IOMode ioMode) {
+        this->ioMode = ioMode;
+        return *this;
+    }
+    
+    /// Loads only the box starting at x, y, z, a size of 0 extends it to the end of the axis
+    RawLoader &setRegion(unsigned x, unsigned y, unsigned z, unsigned width=0, unsigned height=0, unsigned depth=0) {
+        regionX = x;
+        regionY = y;
+        regionZ = z;
+        regionWidth = width;
+        regionHeight = height;
+        regionDepth = depth;
+        return *this;
+    }
+    
+    /// Loads every nth voxel along each axis
+    RawLoader &setStride(unsigned x, unsigned y, unsigned z) {
+        strideX = qMax(1u, x);
+        strideY = qMax(1u, y);
+        strideZ = qMax(1u, z);
+        return *this;
+    }
+    
+    /// Whether only a region or a subsample of the volume is loaded
+    bool hasRegion() const {
+        return regionX > 0 || regionY > 0 || regionZ > 0 || regionWidth > 0 || regionHeight > 0 || regionDepth > 0
+                || strideX > 1 || strideY > 1 || strideZ > 1;
+    }
+    
+    RawLoader &setSlabSize(qint64 bytes) {
+        this->slabSize = bytes;
+        return *this;
+    }
+    
+    /// Where the voxels start in the file, for formats with a header
+    RawLoader &setDataOffset(qint64 offset) {
+        this->dataOffset = offset;
+        return *this;
+    }
+    
+    /// The voxels are a gzip or zlib stream, otherwise that is told by suffix and magic number
+    RawLoader &setCompressed(bool compressed) {
+        this->compressed = compressed;
+        return *this;
+    }
+    
+    /// Values are two's complement, they are shifted onto the unsigned range
+    RawLoader &setSigned(bool signedValues) {
+        this->signedValues = signedValues;
+        return *this;
+    }
+    
+    RawLoader &setSlabCallback(SlabCallback callback) {
+        this->slabCallback = callback;
+        return *this;
+    }
+    
+    /// Loads into dst, which has to hold the whole volume, instead of a buffer of its own. loadFile returns dst then, it's never released
+    RawLoader &setDestination(uint8_t *dst) {
+        this->destination = dst;
+        return *this;
+    }
+    
     /*RawLoader &setAspectratio(double x, double y, double z) {
         aX = x;
         aY = y;
@@ -46,7 +125,44 @@ public:
     }*/
     
 private:
+    /// Fills data with the next bytes of the volume, returns how many there were or -1 on errors
+    typedef std::function<qint64(uint8_t *data, qint64 bytes)> StreamReader;
+    
+    uint8_t *loadMapped(const QString &filename, size_t voxelCount, qint64 bytesToRead);
+    uint8_t *loadStreamed(const QString &filename, qint64 bytesToRead);
+    uint8_t *loadStreamed(const StreamReader &read, qint64 bytesToRead);
+    uint8_t *loadCompressed(const QString &filename, qint64 bytesToRead);
+    uint8_t *loadRegion(const QString &filename);
+    
+    /// Size of the region that is loaded, before the strides are applied
+    void regionSize(unsigned &width, unsigned &height, unsigned &depth) const;
+    
+    /// The buffer the voxels are loaded into, the destination if there is one
+    uint8_t *allocate(qint64 bytes) const {
+        return destination != nullptr ? destination : new uint8_t[bytes];
+    }
+    
+    /// Frees a buffer from allocate when the load fails
+    void release(uint8_t *data) const {
+        if(data != destination) {
+            delete[] data;
+        }
+    }
+    
     ByteOrder byteOrder = ByteOrder::BO_LITTLE_ENDIAN;
+    IOMode ioMode = IOMode::IO_MMAP;
+    
+    qint64 dataOffset = 0;
+    bool compressed = false;
+    bool signedValues = false;
+    
+    unsigned regionX = 0, regionY = 0, regionZ = 0;
+    unsigned regionWidth = 0, regionHeight = 0, regionDepth = 0;
+    unsigned strideX = 1, strideY = 1, strideZ = 1;
+    
+    qint64 slabSize = 16*1024*1024;
+    SlabCallback slabCallback;
+    uint8_t *destination = nullptr;
     //double aX, aY, aZ;
 
 };
@@ -0,0 +1,312 @@
+#include "VolumeCache.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+
+#include <cstring>
+#include <memory>
+
+#include "common.h"
+
+namespace {
+
+const char cacheMagic[8] = {'V', 'O', 'L', 'C', 'A', 'C', 'H', 'E'};
+const quint32 cacheVersion = 8;
+
+// the voxels start on a page so they can be mapped
+const quint64 cacheAlignment = 4096;
+
+struct CacheHeader {
+    char magic[8];
+    quint32 version;
+    quint32 headerSize;
+    
+    // what the cache was made from
+    char source[1024];
+    char key[256];
+    quint64 sourceSize;
+    qint64 sourceModified;
+    
+    // SHA-1 of the path, size and modification time of every other file the volume was read from
+    char dataFiles[20];
+    
+    quint32 width, height, depth;
+    quint32 bitDepth;
+    
+    // value range of the voxels
+    float min, max;
+    
+    quint64 dataOffset, dataSize;
+    quint64 histogramOffset;
+    quint32 histogramBins;
+    
+    // distance between neighbouring voxels along each axis
+    float spacing[3];
+    
+    // min/max grid, macrocellSize is in bytes and 0 if there is none
+    quint64 macrocellOffset, macrocellSize;
+    quint32 macrocellEdge;
+    
+    // the downsampled levels one after another, pyramidSize is their total size in bytes
+    quint64 pyramidOffset, pyramidSize;
+    quint32 pyramidLevels;
+};
+
+bool copyString(char *dst, size_t size, const QString &str)
+{
+    QByteArray utf8 = str.toUtf8();
+    
+    if((size_t)utf8.size() >= size) {
+        return false;
+    }
+    
+    memset(dst, 0, size);
+    memcpy(dst, utf8.constData(), utf8.size());
+    
+    return true;
+}
+
+/// Fills in everything that identifies the source, false if it can't be cached
+bool describeSource(const QString &source, const QString &key, const QStringList &dataFiles, CacheHeader &header)
+{
+    QFileInfo info(source);
+    
+    if(!info.exists()) {
+        return false;
+    }
+    
+    header.sourceSize = info.size();
+    header.sourceModified = info.lastModified().toMSecsSinceEpoch();
+    
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    
+    for(const QString &file : dataFiles) {
+        QFileInfo dataInfo(file);
+        hash.addData(QString("%1 %2 %3\n").arg(dataInfo.absoluteFilePath()).arg(dataInfo.size())
+                     .arg(dataInfo.lastModified().toMSecsSinceEpoch()).toUtf8());
+    }
+    
+    QByteArray digest = hash.result();
+    memcpy(header.dataFiles, digest.constData(), qMin(size_t(digest.size()), sizeof(header.dataFiles)));
+    
+    return copyString(header.source, sizeof(header.source), info.absoluteFilePath())
+            && copyString(header.key, sizeof(header.key), key);
+}
+
+}
+
+QString VolumeCache::cachePath(const QString &source)
+{
+    return source + ".vcache";
+}
+
+bool VolumeCache::write(const QString &source, const QString &key, const QStringList &dataFiles,
+                        unsigned width, unsigned height, unsigned depth, unsigned bitDepth,
+                        const uint8_t *data, const QVector<quint64> &histogram, const QVector3D &spacing,
+                        const Volume::Macrocells &macrocells, const Volume::Pyramid &pyramid)
+{
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    
+    if(!describeSource(source, key, dataFiles, header)) {
+        return false;
+    }
+    
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.headerSize = sizeof(header);
+    
+    header.width = width;
+    header.height = height;
+    header.depth = depth;
+    header.bitDepth = bitDepth;
+    
+    header.spacing[0] = spacing.x();
+    header.spacing[1] = spacing.y();
+    header.spacing[2] = spacing.z();
+    
+    // the macrocells cover every voxel, without them the bins of integers tell the range
+    if(!macrocells.empty()) {
+        Volume::valueRange(macrocells, header.min, header.max);
+    } else {
+        header.min = histogram.size();
+        header.max = 0;
+        
+        for(int i=0; i<histogram.size(); ++i) {
+            if(histogram[i] > 0) {
+                header.min = qMin(header.min, float(i));
+                header.max = i;
+            }
+        }
+    }
+    
+    header.dataOffset = cacheAlignment;
+    header.dataSize = quint64(width)*height*depth*qCeil(bitDepth/8.);
+    header.histogramOffset = header.dataOffset + header.dataSize;
+    header.histogramBins = histogram.size();
+    
+    header.macrocellOffset = header.histogramOffset + histogram.size()*sizeof(quint64);
+    header.macrocellSize = macrocells.size()*sizeof(Volume::Macrocell);
+    header.macrocellEdge = Volume::macrocellSize;
+    
+    header.pyramidOffset = header.macrocellOffset + header.macrocellSize;
+    header.pyramidSize = 0;
+    header.pyramidLevels = pyramid.size();
+    
+    for(const Volume::Level &level : pyramid) {
+        header.pyramidSize += level.data.size();
+    }
+    
+    // write under a temporary name, a half written cache must never be picked up
+    QString path = cachePath(source);
+    QFile f(path + ".tmp");
+    
+    if(!f.open(QFile::WriteOnly)) {
+        qDebug() << "Could not write" << f.fileName();
+        return false;
+    }
+    
+    bool ok = f.write((const char*)&header, sizeof(header)) == sizeof(header)
+            && f.seek(header.dataOffset)
+            && f.write((const char*)data, header.dataSize) == (qint64)header.dataSize
+            && f.write((const char*)histogram.constData(), histogram.size()*sizeof(quint64)) == qint64(histogram.size()*sizeof(quint64))
+            && f.write((const char*)macrocells.data(), header.macrocellSize) == (qint64)header.macrocellSize;
+    
+    for(const Volume::Level &level : pyramid) {
+        ok = ok && f.write((const char*)level.data.data(), level.data.size()) == (qint64)level.data.size();
+    }
+    
+    f.close();
+    
+    if(!ok) {
+        qDebug() << "Could not write" << f.fileName();
+        f.remove();
+        return false;
+    }
+    
+    QFile::remove(path);
+    
+    return f.rename(path);
+}
+
+bool VolumeCache::open(const QString &source, const QString &key, const QStringList &dataFiles)
+{
+    CacheHeader expected, header;
+    memset(&expected, 0, sizeof(expected));
+    
+    if(!describeSource(source, key, dataFiles, expected)) {
+        return false;
+    }
+    
+    // shared so that the mapped voxels keep the file open
+    std::shared_ptr<QFile> f = std::make_shared<QFile>(cachePath(source));
+    
+    if(!f->open(QFile::ReadOnly) || f->read((char*)&header, sizeof(header)) != sizeof(header)) {
+        return false;
+    }
+    
+    if(memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || header.version != cacheVersion
+            || header.headerSize != sizeof(header)) {
+        return false;
+    }
+    
+    if(memcmp(header.source, expected.source, sizeof(header.source)) != 0
+            || memcmp(header.key, expected.key, sizeof(header.key)) != 0
+            || memcmp(header.dataFiles, expected.dataFiles, sizeof(header.dataFiles)) != 0
+            || header.sourceSize != expected.sourceSize || header.sourceModified != expected.sourceModified) {
+        return false;
+    }
+    
+    quint64 histogramSize = quint64(header.histogramBins)*sizeof(quint64);
+    
+    if(header.dataSize != quint64(header.width)*header.height*header.depth*qCeil(header.bitDepth/8.)
+            || header.histogramOffset + histogramSize > (quint64)f->size()
+            || header.dataOffset + header.dataSize > header.histogramOffset) {
+        return false;
+    }
+    
+    histogram.resize(header.histogramBins);
+    
+    if(!f->seek(header.histogramOffset)
+            || f->read((char*)histogram.data(), histogramSize) != (qint64)histogramSize) {
+        histogram.clear();
+        return false;
+    }
+    
+    // a grid of another cell size is left out, the volume builds its own then
+    const quint64 cells = quint64((header.width + Volume::macrocellSize-1)/Volume::macrocellSize)
+            * ((header.height + Volume::macrocellSize-1)/Volume::macrocellSize)
+            * ((header.depth + Volume::macrocellSize-1)/Volume::macrocellSize);
+    
+    macrocells.clear();
+    
+    if(header.macrocellEdge == Volume::macrocellSize && header.macrocellSize == cells*sizeof(Volume::Macrocell)
+            && header.macrocellOffset + header.macrocellSize <= (quint64)f->size()) {
+        macrocells.resize(cells);
+        
+        if(!f->seek(header.macrocellOffset)
+                || f->read((char*)macrocells.data(), header.macrocellSize) != (qint64)header.macrocellSize) {
+            macrocells.clear();
+        }
+    }
+    
+    // the levels halve the size until the header's count is reached, just like Volume::buildPyramid
+    const unsigned bytesPerCell = qCeil(header.bitDepth/8.);
+    unsigned w = header.width, h = header.height, d = header.depth;
+    quint64 pyramidSize = 0;
+    
+    // a level count no size halves down to is as broken as a wrong size
+    pyramid.resize(qMin(header.pyramidLevels, 32u));
+    
+    for(Volume::Level &level : pyramid) {
+        level.width = w = qMax(1u, w/2);
+        level.height = h = qMax(1u, h/2);
+        level.depth = d = qMax(1u, d/2);
+        pyramidSize += quint64(w)*h*d*bytesPerCell;
+    }
+    
+    if(pyramid.size() != header.pyramidLevels || pyramidSize != header.pyramidSize || header.pyramidOffset + header.pyramidSize > (quint64)f->size()
+            || !f->seek(header.pyramidOffset)) {
+        histogram.clear();
+        macrocells.clear();
+        pyramid.clear();
+        return false;
+    }
+    
+    for(Volume::Level &level : pyramid) {
+        level.data.resize(size_t(level.width)*level.height*level.depth*bytesPerCell);
+        
+        if(f->read((char*)level.data.data(), level.data.size()) != (qint64)level.data.size()) {
+            histogram.clear();
+            macrocells.clear();
+            pyramid.clear();
+            return false;
+        }
+    }
+    
+    uint8_t *mapped = f->map(header.dataOffset, header.dataSize);
+    
+    if(mapped == nullptr) {
+        histogram.clear();
+        macrocells.clear();
+        pyramid.clear();
+        return false;
+    }
+    
+    data = VolumeBuffer(mapped, [f](uint8_t *data) {
+        f->unmap(data);
+    });
+    
+    width = header.width;
+    height = header.height;
+    depth = header.depth;
+    bitDepth = header.bitDepth;
+    spacing = QVector3D(header.spacing[0], header.spacing[1], header.spacing[2]);
+    valueMin = header.min;
+    valueMax = header.max;
+    
+    return true;
+}
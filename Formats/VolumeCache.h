@@ -0,0 +1,73 @@
+#ifndef VOLUMECACHE_H
+#define VOLUMECACHE_H
+
+#include "Loader.h"
+#include "Volume.h"
+
+#include <QString>
+#include <QStringList>
+#include <QVector3D>
+#include <QVector>
+#include <cstdint>
+
+/**
+ * Preprocessed copy of a volume, stored next to its source as <source>.vcache.
+ *
+ * The file holds a fixed header, the voxels in host byte order exactly as they
+ * are uploaded to the texture (page aligned, so they can be mapped), the
+ * histogram with one bin per value, the min/max macrocells and the levels of
+ * the pyramid. It is only used while the path, size and modification time of
+ * the source and of the data files it refers to and the loader settings still
+ * match.
+ */
+class VolumeCache
+{
+public:
+    static QString cachePath(const QString &source);
+    
+    /// Stores a loaded volume for the next time source is opened with the same key and unchanged data files
+    static bool write(const QString &source, const QString &key, const QStringList &dataFiles,
+                      unsigned width, unsigned height, unsigned depth, unsigned bitDepth,
+                      const uint8_t *data, const QVector<quint64> &histogram, const QVector3D &spacing = QVector3D(1, 1, 1),
+                      const Volume::Macrocells &macrocells = Volume::Macrocells(), const Volume::Pyramid &pyramid = Volume::Pyramid());
+    
+    /// Maps the cached volume of source, false if there is no usable one
+    bool open(const QString &source, const QString &key, const QStringList &dataFiles = QStringList());
+    
+    unsigned getWidth() const {return width;}
+    unsigned getHeight() const {return height;}
+    unsigned getDepth() const {return depth;}
+    unsigned getBitDepth() const {return bitDepth;}
+    QVector3D getSpacing() const {return spacing;}
+    
+    /// The smallest and largest value that occurs in the volume
+    void getValueRange(float &min, float &max) const {
+        min = valueMin;
+        max = valueMax;
+    }
+    
+    /// The mapped voxels, unmapped once the last copy is gone
+    VolumeBuffer getData() const {return data;}
+    
+    const QVector<quint64> &getHistogram() const {return histogram;}
+    
+    /// Empty if the cache holds none for the current macrocell size
+    Volume::Macrocells takeMacrocells() {return move(macrocells);}
+    
+    /// The levels below full resolution, read from the cache so the volume doesn't have to be walked
+    Volume::Pyramid takePyramid() {return move(pyramid);}
+
+private:
+    unsigned width = 0, height = 0, depth = 0;
+    unsigned bitDepth = 8;
+    QVector3D spacing = QVector3D(1, 1, 1);
+    float valueMin = 0, valueMax = 0;
+    
+    VolumeBuffer data;
+    
+    QVector<quint64> histogram;
+    Volume::Macrocells macrocells;
+    Volume::Pyramid pyramid;
+};
+
+#endif // VOLUMECACHE_H
@@ -0,0 +1,203 @@
+#include "SequencePlayer.h"
+
+#include <QCollator>
+#include <QDir>
+#include <QFileInfo>
+#include <QtConcurrent>
+
+#include <algorithm>
+
+#include "Formats/RawLoader.h"
+#include "Widgets/VolRenderer.h"
+
+SequencePlayer::SequencePlayer(VolRenderer *renderer, QObject *parent)
+    : QObject(parent), renderer(renderer)
+{
+    timer = new QTimer(this);
+    timer->setInterval(100);
+    connect(timer, &QTimer::timeout, this, &SequencePlayer::nextFrame);
+    
+    fetch = new QFutureWatcher<bool>(this);
+    connect(fetch, &QFutureWatcher<bool>::finished, this, &SequencePlayer::frameFetched);
+}
+
+SequencePlayer::~SequencePlayer()
+{
+    stop();
+}
+
+bool SequencePlayer::open(const QString &path, unsigned width, unsigned height, unsigned depth, unsigned bitDepth,
+                          Loader::ByteOrder byteOrder, bool linearize)
+{
+    this->width = width;
+    this->height = height;
+    this->depth = depth;
+    this->bitDepth = bitDepth;
+    this->byteOrder = byteOrder;
+    this->linearize = linearize;
+    
+    frames.clear();
+    
+    QFileInfo info(path);
+    qint64 frameBytes = qint64(width)*height*depth*qCeil(bitDepth/8.);
+    
+    if(frameBytes == 0 || !info.exists()) {
+        error = QString("Could not open %1").arg(path);
+        return false;
+    }
+    
+    if(info.size() == frameBytes) {
+        // one frame per file, in natural order so that frame10 comes after frame9
+        QStringList files = info.dir().entryList(QStringList() << "*." + info.suffix(), QDir::Files);
+        
+        QCollator collator;
+        collator.setNumericMode(true);
+        std::sort(files.begin(), files.end(), collator);
+        
+        for(const QString &file : files) {
+            QString filename = info.dir().filePath(file);
+            
+            if(QFileInfo(filename).size() == frameBytes) {
+                frames.append({filename, 0});
+            }
+        }
+    } else {
+        for(qint64 offset=0; offset+frameBytes <= info.size(); offset+=frameBytes) {
+            frames.append({path, offset});
+        }
+    }
+    
+    if(frames.size() < 2) {
+        error = QString("%1 holds no sequence of %2x%3x%4 volumes").arg(path).arg(width).arg(height).arg(depth);
+        return false;
+    }
+    
+    return true;
+}
+
+void SequencePlayer::start()
+{
+    if(started) {
+        return;
+    }
+    
+    renderer->beginSequence(width, height, depth, qCeil(bitDepth/8.)*8);
+    
+    started = true;
+    current = 0;
+    
+    prefetch(1);
+}
+
+void SequencePlayer::stop()
+{
+    timer->stop();
+    
+    if(!started) {
+        return;
+    }
+    
+    fetch->waitForFinished();
+    
+    started = false;
+    fetched = -1;
+    ready = due = false;
+    
+    renderer->endSequence();
+}
+
+void SequencePlayer::play()
+{
+    start();
+    timer->start();
+}
+
+void SequencePlayer::pause()
+{
+    timer->stop();
+}
+
+void SequencePlayer::setFrameRate(double fps)
+{
+    timer->setInterval(qMax(1, qRound(1000/fps)));
+}
+
+void SequencePlayer::nextFrame()
+{
+    if(ready) {
+        present();
+    } else {
+        // show it as soon as it's there, frames are never skipped
+        due = true;
+    }
+}
+
+void SequencePlayer::frameFetched()
+{
+    if(!started) {
+        return;
+    }
+    
+    if(!fetch->result()) {
+        stop();
+        emit failed(fetchError);
+        return;
+    }
+    
+    ready = true;
+    
+    if(due) {
+        present();
+    }
+}
+
+void SequencePlayer::prefetch(int frame)
+{
+    uint8_t *dst = renderer->mapSequenceFrame();
+    
+    fetched = frame;
+    ready = false;
+    
+    if(dst == nullptr) {
+        fetchError = "Could not map a pixel buffer";
+        fetch->setFuture(QtConcurrent::run([]() {return false;}));
+        return;
+    }
+    
+    fetch->setFuture(QtConcurrent::run([this, frame, dst]() {
+        return readFrame(frame, dst, &fetchError);
+    }));
+}
+
+void SequencePlayer::present()
+{
+    renderer->presentSequenceFrame();
+    
+    current = fetched;
+    due = false;
+    
+    emit frameChanged(current);
+    
+    // the next frame loads while this one is shown
+    prefetch((current + 1) % frames.size());
+}
+
+bool SequencePlayer::readFrame(int frame, uint8_t *dst, QString *error) const
+{
+    RawLoader loader;
+    
+    loader.setDataOffset(frames[frame].offset);
+    
+    // the window is fixed from frame 0, the range of the others isn't needed
+    loader.setLinearize(frame == 0 && linearize);
+    
+    // normalized right into the pixel buffer, without a frame sized buffer in between
+    loader.setDestination(dst);
+    
+    if(loader.loadFile(frames[frame].filename, width, height, depth, byteOrder, bitDepth) == nullptr) {
+        *error = loader.errorString();
+        return false;
+    }
+    
+    return true;
+}
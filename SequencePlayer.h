@@ -0,0 +1,91 @@
+#ifndef SEQUENCEPLAYER_H
+#define SEQUENCEPLAYER_H
+
+#include <QFutureWatcher>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include "Formats/Loader.h"
+
+class VolRenderer;
+
+/**
+ * Plays a time series of raw volumes of the same size in a VolRenderer.
+ *
+ * The frames are either the files of a directory or the volumes stored one
+ * after another in a single file. While frame n is shown, frame n+1 is read
+ * and normalized on a worker thread straight into a pixel buffer of the
+ * renderer, from where it is copied into the existing texture when it is due.
+ * The Volume itself keeps the frame that was loaded first.
+ */
+class SequencePlayer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SequencePlayer(VolRenderer *renderer, QObject *parent = 0);
+    ~SequencePlayer();
+    
+    /// Finds the frames for path, a file with exactly one frame stands for all files of its directory with the same suffix
+    bool open(const QString &path, unsigned width, unsigned height, unsigned depth, unsigned bitDepth,
+              Loader::ByteOrder byteOrder, bool linearize);
+    
+    int frameCount() const {return frames.size();}
+    int currentFrame() const {return current;}
+    
+    /// The file frame 0 is read from, it's loaded like a single volume
+    QString firstFile() const {return frames.isEmpty() ? QString() : frames[0].filename;}
+    
+    const QString &errorString() const {return error;}
+
+signals:
+    void frameChanged(int frame);
+    void failed(const QString &error);
+
+public slots:
+    /// Takes over the texture, which shows frame 0 at this point
+    void start();
+    void stop();
+    
+    void play();
+    void pause();
+    void setFrameRate(double fps);
+
+private slots:
+    void nextFrame();
+    void frameFetched();
+
+private:
+    struct Frame {
+        QString filename;
+        qint64 offset;
+    };
+    
+    void prefetch(int frame);
+    void present();
+    
+    bool readFrame(int frame, uint8_t *dst, QString *error) const;
+    
+    VolRenderer *renderer;
+    
+    QVector<Frame> frames;
+    unsigned width = 0, height = 0, depth = 0, bitDepth = 8;
+    Loader::ByteOrder byteOrder = Loader::BO_LITTLE_ENDIAN;
+    bool linearize = true;
+    
+    bool started = false;
+    int current = 0;
+    
+    // the frame in the pixel buffer, whether it's complete and whether it should have been shown already
+    int fetched = -1;
+    bool ready = false;
+    bool due = false;
+    QString fetchError;
+    
+    QTimer *timer;
+    QFutureWatcher<bool> *fetch;
+    
+    QString error;
+};
+
+#endif // SEQUENCEPLAYER_H
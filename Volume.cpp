@@ -1,92 +1,531 @@
 #include "Volume.h"
+#include "VolumeView.h"
 
+#include <QMutex>
 #include <qmath.h>
 
-Volume::~Volume()
+#include <cstring>
+#include <type_traits>
+
+namespace {
+
+/// Source voxels and their weights for one side of a level, four taps per output voxel
+struct Taps {
+    vector<size_t> index;
+    vector<float> weight;
+};
+
+Taps downsampleTaps(unsigned size, unsigned halfSize, Volume::PyramidFilter filter)
 {
-    if(volData != nullptr) {
-        delete [] volData;
+    // output voxel i lies between 2i and 2i+1, the box filter leaves out the outer taps
+    static const float box[4] = {0, .5f, .5f, 0};
+    static const float gaussian[4] = {1/8.f, 3/8.f, 3/8.f, 1/8.f};
+    
+    const float *weights = filter == Volume::PF_GAUSSIAN ? gaussian : box;
+    
+    Taps taps;
+    
+    for(unsigned i=0; i<halfSize; ++i) {
+        for(int k=0; k<4; ++k) {
+            taps.index.push_back(qBound(0, int(2*i)-1+k, int(size)-1));
+            taps.weight.push_back(weights[k]);
+        }
     }
+    
+    return taps;
 }
 
-uint8_t *Volume::voxelAt(int x, int y, int z)
+/// Copies the voxels into bricks of size^3, the apron and the part beyond the border repeat the nearest voxel
+template<typename T>
+struct BrickVoxels {
+    static void run(const uint8_t *data, int width, int height, int depth, unsigned size, uint8_t *bricks)
+    {
+        const VolumeView<T> src(data, width, height, depth);
+        
+        const size_t pitch = size + 2;
+        const unsigned bricksX = (width + size-1)/size, bricksY = (height + size-1)/size, bricksZ = (depth + size-1)/size;
+        
+        parallelFor(size_t(bricksX)*bricksY*bricksZ, [&](size_t begin, size_t end) {
+            for(size_t b=begin; b<end; ++b) {
+                int x0 = (b % bricksX)*size, y0 = (b / bricksX % bricksY)*size, z0 = (b / bricksX / bricksY)*size;
+                T *dst = (T*)bricks + b*pitch*pitch*pitch;
+                
+                for(int z=-1; z<=int(size); ++z) {
+                    for(int y=-1; y<=int(size); ++y) {
+                        const T *row = src.row(qBound(0, y0+y, height-1), qBound(0, z0+z, depth-1));
+                        
+                        // only the first and last voxel of a row can be outside
+                        for(int x=-1; x<=int(size); ++x) {
+                            *dst++ = row[qBound(0, x0+x, width-1)];
+                        }
+                    }
+                }
+            }
+        }, 1);
+    }
+};
+
+/// Copies the part of every brick that lies in the slice, each one from its own contiguous memory
+template<typename T>
+struct CopySlice {
+    static void run(const Volume &vol, Volume::Axis axis, unsigned index, uint8_t *slice)
+    {
+        const size_t width = vol.getWidth(), height = vol.getHeight();
+        T *dst = (T*)slice;
+        
+        vol.forEachBrick([&](const Volume::Brick &brick) {
+            const VolumeView<T> src(brick);
+            
+            if(axis == Volume::AXIS_Z && index >= brick.z && index < brick.z + brick.depth) {
+                for(unsigned y=0; y<brick.height; ++y) {
+                    memcpy(&dst[(brick.y + y)*width + brick.x], src.row(y, index - brick.z), brick.width*sizeof(T));
+                }
+            } else if(axis == Volume::AXIS_Y && index >= brick.y && index < brick.y + brick.height) {
+                for(unsigned z=0; z<brick.depth; ++z) {
+                    memcpy(&dst[(brick.z + z)*width + brick.x], src.row(index - brick.y, z), brick.width*sizeof(T));
+                }
+            } else if(axis == Volume::AXIS_X && index >= brick.x && index < brick.x + brick.width) {
+                for(unsigned z=0; z<brick.depth; ++z) {
+                    for(unsigned y=0; y<brick.height; ++y) {
+                        dst[(brick.z + z)*height + brick.y + y] = src.at(index - brick.x, y, z);
+                    }
+                }
+            }
+        });
+    }
+};
+
+template<typename T>
+struct Downsample {
+    static void run(const uint8_t *data, unsigned width, unsigned height, unsigned depth, Volume::Level &level, Volume::PyramidFilter filter)
+    {
+        Taps xTaps = downsampleTaps(width, level.width, filter);
+        Taps yTaps = downsampleTaps(height, level.height, filter);
+        Taps zTaps = downsampleTaps(depth, level.depth, filter);
+        
+        const T *src = (const T*)data;
+        T *dst = (T*)level.data.data();
+        
+        parallelFor(level.depth, [&](size_t begin, size_t end) {
+            for(size_t z=begin; z<end; ++z) {
+                for(size_t y=0; y<level.height; ++y) {
+                    for(size_t x=0; x<level.width; ++x) {
+                        float sum = 0;
+                        
+                        for(size_t k=z*4; k<z*4+4; ++k) {
+                            for(size_t j=y*4; j<y*4+4; ++j) {
+                                float wzy = zTaps.weight[k]*yTaps.weight[j];
+                                
+                                if(wzy == 0) {
+                                    continue;
+                                }
+                                
+                                const T *row = &src[(zTaps.index[k]*height + yTaps.index[j])*width];
+                                
+                                for(size_t i=x*4; i<x*4+4; ++i) {
+                                    sum += wzy*xTaps.weight[i]*row[xTaps.index[i]];
+                                }
+                            }
+                        }
+                        
+                        dst[(z*level.height + y)*level.width + x] = std::is_integral<T>::value ? T(sum + .5f) : T(sum);
+                    }
+                }
+            }
+        }, 1);
+    }
+};
+
+/// Where the values of a volume go in its histogram, integers have a bin each
+struct Bins {
+    unsigned last;
+    float min, scale;
+    
+    unsigned operator()(uint8_t value) const {return value;}
+    unsigned operator()(uint16_t value) const {return value;}
+    
+    unsigned operator()(float value) const {
+        // nan ends up in the first bin
+        float bin = (value - min)*scale;
+        return bin > 0 ? qMin(unsigned(bin), last) : 0;
+    }
+};
+
+/// Counts the values of all bricks, every thread into its own bins which are added up at the end
+template<typename T>
+struct CountValues {
+    static void run(size_t count, const function<Volume::Brick(size_t i)> &getBrick, QVector<quint64> &histogram,
+                    float valueMin, float valueMax)
+    {
+        const unsigned lastBin = histogram.size()-1;
+        const Bins bins = {lastBin, valueMin, valueMax > valueMin ? lastBin/(valueMax - valueMin) : 0};
+        QMutex mutex;
+        
+        parallelFor(count, [&](size_t begin, size_t end) {
+            vector<quint64> counts(lastBin+1, 0);
+            
+            for(size_t i=begin; i<end; ++i) {
+                const VolumeView<T> view(getBrick(i));
+                
+                for(unsigned z=0; z<view.getDepth(); ++z) {
+                    for(unsigned y=0; y<view.getHeight(); ++y) {
+                        const T *row = view.row(y, z);
+                        
+                        for(unsigned x=0; x<view.getWidth(); ++x) {
+                            counts[bins(row[x])]++;
+                        }
+                    }
+                }
+            }
+            
+            QMutexLocker lock(&mutex);
+            
+            for(unsigned i=0; i<=lastBin; ++i) {
+                histogram[i] += counts[i];
+            }
+        }, 1);
+    }
+};
+
+template<typename T>
+struct MinMaxCells {
+    static void run(const uint8_t *data, unsigned width, unsigned height, unsigned depth, Volume::Macrocells &cells)
+    {
+        const unsigned size = Volume::macrocellSize;
+        const unsigned cellsX = (width + size-1)/size, cellsY = (height + size-1)/size;
+        const T *src = (const T*)data;
+        
+        parallelFor(cells.size(), [&](size_t begin, size_t end) {
+            for(size_t c=begin; c<end; ++c) {
+                // one voxel more on each side, samples near the border of a cell interpolate with them
+                unsigned x0 = (c % cellsX)*size, y0 = (c / cellsX % cellsY)*size, z0 = (c / cellsX / cellsY)*size;
+                unsigned x1 = qMin(x0 + size, width-1), y1 = qMin(y0 + size, height-1), z1 = qMin(z0 + size, depth-1);
+                x0 = x0 > 0 ? x0-1 : 0;
+                y0 = y0 > 0 ? y0-1 : 0;
+                z0 = z0 > 0 ? z0-1 : 0;
+                
+                T min = src[(size_t(z0)*height + y0)*width + x0], max = min;
+                
+                for(unsigned z=z0; z<=z1; ++z) {
+                    for(unsigned y=y0; y<=y1; ++y) {
+                        const T *row = &src[(size_t(z)*height + y)*width];
+                        
+                        for(unsigned x=x0; x<=x1; ++x) {
+                            min = qMin(min, row[x]);
+                            max = qMax(max, row[x]);
+                        }
+                    }
+                }
+                
+                cells[c].min = min;
+                cells[c].max = max;
+            }
+        }, 1);
+    }
+};
+}
+
+const uint8_t *Volume::voxelAt(int x, int y, int z) const
 {
     x = qBound(0, x, (int)width-1);
     y = qBound(0, y, (int)height-1);
     z = qBound(0, z, (int)depth-1);
-    int index = x + y*width + z*width*height;
 
-    return &volData[index*bytesPerCell];
+    return &volData.data()[voxelIndex(x, y, z)*bytesPerCell];
 }
 
-uint8_t *Volume::voxelAt(unsigned i)
+const uint8_t *Volume::voxelAt(size_t i) const
 {
-    return &volData[i*bytesPerCell];
+    if(brickSize > 0) {
+        return &volData.data()[voxelIndex(i % width, i / width % height, i / width / height)*bytesPerCell];
+    }
+    
+    return &volData.data()[i*bytesPerCell];
 }
 
-uint8_t *Volume::voxelAt(int x, int y, int z) const
+size_t Volume::voxelIndex(unsigned x, unsigned y, unsigned z) const
 {
-    x = qBound(0, x, (int)width-1);
-    y = qBound(0, y, (int)height-1);
-    z = qBound(0, z, (int)depth-1);
-    int index = x + y*width + z*width*height;
+    if(brickSize == 0) {
+        return x + size_t(y)*width + size_t(z)*width*height;
+    }
+    
+    const size_t pitch = brickSize + 2;
+    const size_t bricksX = (width + brickSize-1)/brickSize, bricksY = (height + brickSize-1)/brickSize;
+    
+    size_t brick = x/brickSize + (y/brickSize)*bricksX + (z/brickSize)*bricksX*bricksY;
+    
+    // past the apron in front of the brick
+    return brick*pitch*pitch*pitch + ((z%brickSize + 1)*pitch + y%brickSize + 1)*pitch + x%brickSize + 1;
+}
 
-    return &volData[index*bytesPerCell];
+
+float Volume::densityAt(int x, int y, int z) const
+{
+    return density(voxelAt(x, y, z));
 }
 
-uint8_t *Volume::voxelAt(unsigned i) const
+float Volume::densityAt(size_t i) const
 {
-    return &volData[i*bytesPerCell];
+    return density(voxelAt(i));
 }
 
+float Volume::density(const uint8_t *voxel) const
+{
+    switch(bytesPerCell) {
+    case 4:
+        return *(const float*)voxel;
+    case 2:
+        return *(const uint16_t*)voxel;
+    default:
+        return *voxel;
+    }
+}
+
+const uint8_t *Volume::getData() const
+{
+    return brickSize == 0 ? volData.data() : nullptr;
+}
 
-int Volume::densityAt(int x, int y, int z) const
+const uint8_t *Volume::getSlice(int z) const
 {
-    if(bytesPerCell == 1) {
-        return int(*voxelAt(x, y, z));
+    return brickSize == 0 ? &volData.data()[size_t(z)*width*height*bytesPerCell] : nullptr;
+}
+
+void Volume::extractSlice(Axis axis, unsigned index, uint8_t *dst) const
+{
+    dispatchVoxelType<CopySlice>(bytesPerCell, *this, axis, index, dst);
+}
+
+size_t Volume::brickCount() const
+{
+    const unsigned size = iterationBrickSize();
+    
+    return size_t((width + size-1)/size) * ((height + size-1)/size) * ((depth + size-1)/size);
+}
+
+Volume::Brick Volume::getBrick(size_t i) const
+{
+    const unsigned size = iterationBrickSize();
+    const size_t bricksX = (width + size-1)/size, bricksY = (height + size-1)/size;
+    
+    Brick brick;
+    brick.x = (i % bricksX)*size;
+    brick.y = (i / bricksX % bricksY)*size;
+    brick.z = (i / bricksX / bricksY)*size;
+    brick.width = qMin(size, width - brick.x);
+    brick.height = qMin(size, height - brick.y);
+    brick.depth = qMin(size, depth - brick.z);
+    
+    if(brickSize > 0) {
+        brick.rowPitch = brickSize + 2;
+        brick.slicePitch = brick.rowPitch*brick.rowPitch;
     } else {
-        return int(*(uint16_t*)(voxelAt(x, y, z)));
+        brick.rowPitch = width;
+        brick.slicePitch = size_t(width)*height;
     }
+    
+    brick.data = &volData.data()[voxelIndex(brick.x, brick.y, brick.z)*bytesPerCell];
+    
+    return brick;
 }
 
-int Volume::densityAt(unsigned i) const
+void Volume::forEachBrick(const function<void(const Brick &brick)> &fn) const
 {
-    if(bytesPerCell == 1) {
-        return int(*voxelAt(i));
-    } else {
-        return int(*(uint16_t*)(voxelAt(i)));
+    parallelFor(brickCount(), [&](size_t begin, size_t end) {
+        for(size_t i=begin; i<end; ++i) {
+            fn(getBrick(i));
+        }
+    }, 1);
+}
+
+Volume::Pyramid Volume::buildPyramid(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, const uint8_t *data,
+                                     PyramidFilter filter, unsigned minSize)
+{
+    Pyramid pyramid;
+    
+    while(qMax(width, qMax(height, depth)) > minSize) {
+        Level level;
+        level.width = qMax(1u, width/2);
+        level.height = qMax(1u, height/2);
+        level.depth = qMax(1u, depth/2);
+        level.data.resize(size_t(level.width)*level.height*level.depth*bytesPerCell);
+        
+        // each level is filtered from the previous one
+        dispatchVoxelType<Downsample>(bytesPerCell, data, width, height, depth, level, filter);
+        
+        width = level.width;
+        height = level.height;
+        depth = level.depth;
+        
+        pyramid.push_back(move(level));
+        data = pyramid.back().data.data();
     }
+    
+    return pyramid;
 }
 
-const uint8_t *Volume::getData() const
+QVector<quint64> Volume::calculateHistogram(unsigned width, unsigned height, unsigned depth, unsigned bitDepth, const uint8_t *data,
+                                            float valueMin, float valueMax)
 {
-    return volData;
+    const unsigned bytesPerCell = qCeil(bitDepth/8.);
+    QVector<quint64> histogram(1u << qMin(bitDepth, 16u), 0);
+    
+    // one slice at a time
+    dispatchVoxelType<CountValues>(bytesPerCell, depth, [=](size_t z) {
+        Brick slice = {0, 0, unsigned(z), width, height, 1, &data[z*width*height*bytesPerCell], width, size_t(width)*height};
+        return slice;
+    }, histogram, valueMin, valueMax);
+    
+    return histogram;
 }
 
-const uint8_t *Volume::getSlice(int z) const
+Volume::Macrocells Volume::buildMacrocells(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, const uint8_t *data)
 {
-    return &volData[z*width*height*bytesPerCell];
+    const size_t count = size_t((width + macrocellSize-1)/macrocellSize) * ((height + macrocellSize-1)/macrocellSize)
+            * ((depth + macrocellSize-1)/macrocellSize);
+    
+    Macrocells cells(count);
+    
+    if(count > 0) {
+        dispatchVoxelType<MinMaxCells>(bytesPerCell, data, width, height, depth, cells);
+    }
+    
+    return cells;
 }
 
-void Volume::setVolData(unsigned width, unsigned height, unsigned depth, int bitDepth, uint8_t *data)
+void Volume::valueRange(const Macrocells &macrocells, float &min, float &max)
+{
+    min = macrocells.empty() ? 0 : macrocells[0].min;
+    max = macrocells.empty() ? 0 : macrocells[0].max;
+    
+    for(const Macrocell &cell : macrocells) {
+        min = qMin(min, cell.min);
+        max = qMax(max, cell.max);
+    }
+}
+
+void Volume::getMacrocellCount(unsigned &x, unsigned &y, unsigned &z) const
+{
+    x = (width + macrocellSize-1)/macrocellSize;
+    y = (height + macrocellSize-1)/macrocellSize;
+    z = (depth + macrocellSize-1)/macrocellSize;
+}
+
+const QVector<quint64> &Volume::getHistogram() const
+{
+    if(histogram.isEmpty() && !volData.isNull()) {
+        histogram = QVector<quint64>(1u << qMin(bitDepth, 16u), 0);
+        
+        dispatchVoxelType<CountValues>(bytesPerCell, brickCount(), [this](size_t i) {
+            return getBrick(i);
+        }, histogram, valueMin, valueMax);
+    }
+    
+    return histogram;
+}
+
+float Volume::histogramBin(float value) const
+{
+    if(!hasFloatValues()) {
+        return value;
+    }
+    
+    return valueMax > valueMin ? (value - valueMin)*((1u << 16) - 1)/(valueMax - valueMin) : 0;
+}
+
+void Volume::setVolData(unsigned width, unsigned height, unsigned depth, int bitDepth, VolumeBuffer data,
+                        const QVector<quint64> &histogram, Pyramid pyramid, Macrocells macrocells, unsigned brickSize)
 {
     this->bitDepth = bitDepth;
     this->bytesPerCell = qCeil(bitDepth/8.);
     
-    
     this->width = width;
     this->height = height;
     this->depth = depth;
     
-    if(data != nullptr) {
-        if(volData != nullptr) {
-            delete[] volData;
+    if(!data.isNull()) {
+        // whoever still reads the previous voxels keeps them alive
+        volData = move(data);
+        this->brickSize = brickSize;
+        
+        // the loader or the cache brought the grid along, otherwise it's built from linear data
+        if(macrocells.empty() && brickSize == 0) {
+            macrocells = buildMacrocells(width, height, depth, bytesPerCell, volData.data());
         }
         
-        volData = data;
+        this->macrocells = move(macrocells);
+        valueRange(this->macrocells, valueMin, valueMax);
+        
+        this->histogram = histogram;
+        this->pyramid = move(pyramid);
+        
+        // the whole range until the loader's window is set, floats have none but their values
+        windowLow = hasFloatValues() ? valueMin : 0;
+        windowHigh = hasFloatValues() ? valueMax : (1u << qMin(16, bitDepth)) - 1;
         
         qDebug("Dimensions: %d x %d x %d", width, height, depth);
         
         emit volDataChanged();
     }
 }
+
+void Volume::setWindow(float low, float high)
+{
+    windowLow = low;
+    windowHigh = qMax(low, high);
+    
+    emit windowChanged();
+}
+
+void Volume::setPyramid(Pyramid pyramid)
+{
+    this->pyramid = move(pyramid);
+    
+    emit pyramidChanged();
+}
+
+VolumeBuffer Volume::brickVoxels(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, const uint8_t *data,
+                                 unsigned size)
+{
+    const size_t pitch = size + 2;
+    const size_t bricks = size_t((width + size-1)/size) * ((height + size-1)/size) * ((depth + size-1)/size);
+    
+    uint8_t *bricked = new uint8_t[bricks*pitch*pitch*pitch*bytesPerCell];
+    
+    dispatchVoxelType<BrickVoxels>(bytesPerCell, data, int(width), int(height), int(depth), size, bricked);
+    
+    return VolumeBuffer(bricked);
+}
+
+void Volume::setBrickSize(unsigned size)
+{
+    if(volData.isNull() || size == brickSize) {
+        brickSize = size;
+        return;
+    }
+    
+    if(brickSize > 0 && size > 0) {
+        // from one brick size to another by way of the linear layout
+        setBrickSize(0);
+    }
+    
+    if(size > 0) {
+        volData = brickVoxels(width, height, depth, bytesPerCell, volData.data(), size);
+    } else {
+        uint8_t *data = new uint8_t[voxelCount()*bytesPerCell];
+        
+        // every brick copies its rows back, the apron is left out
+        forEachBrick([&](const Brick &brick) {
+            for(unsigned z=0; z<brick.depth; ++z) {
+                for(unsigned y=0; y<brick.height; ++y) {
+                    memcpy(&data[(brick.x + size_t(brick.y + y)*width + size_t(brick.z + z)*width*height)*bytesPerCell],
+                           &brick.data[(z*brick.slicePitch + y*brick.rowPitch)*bytesPerCell], brick.width*bytesPerCell);
+                }
+            }
+        });
+        
+        volData = VolumeBuffer(data);
+    }
+    
+    brickSize = size;
+}
@@ -2,45 +2,178 @@
 #define VOLUME_H
 
 #include "common.h"
+#include "VolumeBuffer.h"
 
 #include <QObject>
+#include <QVector>
 #include <QVector3D>
 
+#include <vector>
+
 class Volume : public QObject
 {
 Q_OBJECT
 public:
-    Volume() {}
+    enum PyramidFilter {
+        PF_BOX,
+        PF_GAUSSIAN
+    };
     
-    ~Volume();
+    /// A downsampled copy of the volume, each one half the size of the one before
+    struct Level {
+        unsigned width, height, depth;
+        vector<uint8_t> data;
+    };
     
-    uint8_t *voxelAt(int x, int y, int z);
-    uint8_t *voxelAt(unsigned i);
-
-    uint8_t *voxelAt(int x, int y, int z) const;
-    uint8_t *voxelAt(unsigned i) const;
+    typedef vector<Level> Pyramid;
+    
+    /// Smallest and largest value a ray may see in a box of the grid, including the neighbours interpolation reaches
+    struct Macrocell {
+        float min, max;
+    };
+    
+    typedef vector<Macrocell> Macrocells;
+    
+    /// Edge length of a macrocell in voxels
+    static const unsigned macrocellSize = 16;
+    
+    enum Axis {
+        AXIS_X,
+        AXIS_Y,
+        AXIS_Z
+    };
+    
+    /**
+     * A box of the volume. In the bricked layout each brick is stored on its
+     * own and surrounded by a one voxel apron repeating its neighbours, so
+     * filters may reach one voxel beyond it. Bricks at the far sides are cut
+     * off at the border of the volume.
+     */
+    struct Brick {
+        unsigned x, y, z;
+        unsigned width, height, depth;
+        
+        /// Voxel (0, 0, 0) of the brick, rows and slices are rowPitch and slicePitch voxels apart
+        const uint8_t *data;
+        size_t rowPitch, slicePitch;
+    };
+    
+    Volume() {}
+    
+    const uint8_t *voxelAt(int x, int y, int z) const;
+    const uint8_t *voxelAt(size_t i) const;
 
-    int densityAt(int x, int y, int z) const;
-    int densityAt(unsigned i) const;
+    float densityAt(int x, int y, int z) const;
+    float densityAt(size_t i) const;
+    
+    bool hasData() const {return !volData.isNull();}
+    
+    /// The voxels in the current layout, they stay valid for as long as the copy is kept
+    VolumeBuffer getBuffer() const {return volData;}
     
+    /// The voxels in the linear layout, nullptr while they are bricked
     const uint8_t *getData() const;
     const uint8_t *getSlice(int z) const;
     
+    /// Copies the slice at index across axis into dst, its rows follow the first of the other two axes
+    void extractSlice(Axis axis, unsigned index, uint8_t *dst) const;
+    
+    /// Edge length of the bricks, 0 for the linear layout
+    unsigned getBrickSize() const {return brickSize;}
+    
+    /// The bricks of the current layout, the linear one is walked in bricks of 32^3 voxels without apron
+    size_t brickCount() const;
+    Brick getBrick(size_t i) const;
+    
+    /// Calls fn for every brick, several of them in parallel
+    void forEachBrick(const function<void(const Brick &brick)> &fn) const;
+    
     unsigned getWidth() const {return width;}
     unsigned getHeight() const{return height;}
     unsigned getDepth() const {return depth;}
-    unsigned voxelCount() const {return width*height*depth;}
+    size_t voxelCount() const {return size_t(width)*height*depth;}
     
     unsigned getBitDepth() const {return bitDepth;}
-    unsigned getBytesPerCell() const {return qCeil(bitDepth/8);}
+    unsigned getBytesPerCell() const {return bytesPerCell;}
+    
+    /// 32 bit voxels are floats, the others unsigned integers
+    bool hasFloatValues() const {return Loader::isFloat(bitDepth);}
+    
+    /// The smallest and largest value, taken from the macrocells
+    float getValueMin() const {return valueMin;}
+    float getValueMax() const {return valueMax;}
     
+    /// One bin per value up to 16 bits, counted on first use unless it came with the data
+    const QVector<quint64> &getHistogram() const;
+    
+    /// The bin of the histogram value is counted in, floats are spread evenly over the bins from the smallest to the largest value
+    float histogramBin(float value) const;
+    
+    /// The stored values from low to high are spread over the lut, the ones outside get its first or last entry
+    float getWindowLow() const {return windowLow;}
+    float getWindowHigh() const {return windowHigh;}
+    
+    /// Where density falls within the window, from 0 to 1
+    float applyWindow(float density) const {
+        float width = windowHigh - windowLow;
+        return qBound(0.f, (density - windowLow)/(width > 0 ? width : 1), 1.f);
+    }
+    
+    /// The levels below full resolution, the last one is the coarsest
+    const Pyramid &getPyramid() const {return pyramid;}
+    
+    /// The min/max grid, x varies fastest, then y, then z
+    const Macrocells &getMacrocells() const {return macrocells;}
+    void getMacrocellCount(unsigned &x, unsigned &y, unsigned &z) const;
+    
+    /**
+     * Halves the volume until no side is longer than minSize. Every level has
+     * the size OpenGL expects of the matching mipmap level.
+     */
+    static Pyramid buildPyramid(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, const uint8_t *data,
+                                PyramidFilter filter = PF_BOX, unsigned minSize = 32);
+    
+    /// Counts every value of linear data in parallel, floats into as many bins as 16 bits have from valueMin to valueMax
+    static QVector<quint64> calculateHistogram(unsigned width, unsigned height, unsigned depth, unsigned bitDepth, const uint8_t *data,
+                                               float valueMin = 0, float valueMax = 0);
+    
+    /// The min/max of every macrocell of linear data, the cells at the far sides are cut off
+    static Macrocells buildMacrocells(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, const uint8_t *data);
+    
+    /// The smallest and largest value of all cells, 0 for both without any
+    static void valueRange(const Macrocells &macrocells, float &min, float &max);
+    
+    /// Copies linear data into bricks of size^3 plus apron, in parallel and on whichever thread calls it
+    static VolumeBuffer brickVoxels(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, const uint8_t *data,
+                                    unsigned size);
+
 signals:
     void volDataChanged();
+    void windowChanged();
+    void pyramidChanged();
     
 public slots:
-    void setVolData(unsigned width, unsigned height, unsigned depth, int bitDepth, uint8_t *data);
+    /// data is in bricks of brickSize as made by brickVoxels, or linear for 0. Bricked data has to come with its macrocells
+    void setVolData(unsigned width, unsigned height, unsigned depth, int bitDepth, VolumeBuffer data,
+                    const QVector<quint64> &histogram = QVector<quint64>(), Pyramid pyramid = Pyramid(),
+                    Macrocells macrocells = Macrocells(), unsigned brickSize = 0);
+    void setWindow(float low, float high);
+    
+    /// The levels of the current data, when they are built after it was set
+    void setPyramid(Pyramid pyramid);
     
+    /// Rearranges the voxels into bricks of size^3 plus apron, 0 goes back to the linear layout
+    void setBrickSize(unsigned size);
+
 private:
+    /// Offset of voxel x, y, z in volData, in voxels
+    size_t voxelIndex(unsigned x, unsigned y, unsigned z) const;
+    
+    /// The value of a voxel, for single lookups, loops should use a VolumeView
+    float density(const uint8_t *voxel) const;
+    
+    unsigned iterationBrickSize() const {return brickSize > 0 ? brickSize : 32;}
+    
     unsigned width;
     unsigned height;
     unsigned depth;
@@ -48,7 +181,16 @@ private:
     unsigned bitDepth = 8;
     unsigned bytesPerCell = 1;
     
-    uint8_t *volData = nullptr;
+    float windowLow = 0, windowHigh = 255;
+    float valueMin = 0, valueMax = 0;
+    
+    VolumeBuffer volData;
+    
+    unsigned brickSize = 0;
+    
+    mutable QVector<quint64> histogram;
+    Pyramid pyramid;
+    Macrocells macrocells;
     
     friend class VolRenderer;
     friend class SliceWidget;
@@ -0,0 +1,38 @@
+#ifndef VOLUMEBUFFER_H
+#define VOLUMEBUFFER_H
+
+#include "Formats/Loader.h"
+
+#include <cstdint>
+#include <memory>
+
+/**
+ * Voxels that are shared instead of owned.
+ *
+ * Copies refer to the same memory, which is released with the deleter it came
+ * with once the last copy is gone. A task on another thread can keep a copy
+ * and go on reading while the volume switches to new data. The voxels don't
+ * change once they are in a buffer.
+ */
+class VolumeBuffer
+{
+public:
+    VolumeBuffer() {}
+    
+    /// Takes over data as handed out by a loader, nullptr gives an empty buffer
+    explicit VolumeBuffer(uint8_t *data, BufferDeleter deleter = Loader::deleteArray) {
+        if(data != nullptr) {
+            ptr = std::shared_ptr<const uint8_t>(data, [deleter](const uint8_t *data) {
+                deleter(const_cast<uint8_t*>(data));
+            });
+        }
+    }
+    
+    const uint8_t *data() const {return ptr.get();}
+    bool isNull() const {return ptr == nullptr;}
+
+private:
+    std::shared_ptr<const uint8_t> ptr;
+};
+
+#endif // VOLUMEBUFFER_H
@@ -0,0 +1,80 @@
+#ifndef VOLUMEVIEW_H
+#define VOLUMEVIEW_H
+
+#include "Volume.h"
+
+#include <cstddef>
+#include <utility>
+
+/**
+ * Typed access to the voxels of a volume, or of one of its bricks.
+ *
+ * Unlike Volume::densityAt it neither clamps the coordinates nor looks at
+ * the bytes per cell, so loops over a view compile down to plain loads and
+ * can be vectorized. Kernels are written as a template over the voxel type
+ * and run through dispatchVoxelType, which picks the type once per call.
+ */
+template<typename T>
+class VolumeView
+{
+public:
+    typedef T Voxel;
+    
+    /// The whole volume, which has to be in the linear layout
+    explicit VolumeView(const Volume &vol)
+        : data((const T*)vol.getData()), width(vol.getWidth()), height(vol.getHeight()), depth(vol.getDepth()),
+          rowPitch(vol.getWidth()), slicePitch(size_t(vol.getWidth())*vol.getHeight()) {}
+    
+    /// Linear voxels that are not in a volume yet
+    VolumeView(const uint8_t *data, unsigned width, unsigned height, unsigned depth)
+        : data((const T*)data), width(width), height(height), depth(depth),
+          rowPitch(width), slicePitch(size_t(width)*height) {}
+    
+    /// One brick of either layout, its voxel (0, 0, 0) is the origin
+    explicit VolumeView(const Volume::Brick &brick)
+        : data((const T*)brick.data), width(brick.width), height(brick.height), depth(brick.depth),
+          rowPitch(brick.rowPitch), slicePitch(brick.slicePitch) {}
+    
+    /// Voxel x, y, z without any bounds checks, the apron of a brick is at -1 and at its size
+    T at(int x, int y, int z) const {
+        return data[x + y*ptrdiff_t(rowPitch) + z*ptrdiff_t(slicePitch)];
+    }
+    
+    /// The width voxels of row y in slice z, contiguous in memory
+    const T *row(int y, int z) const {
+        return &data[y*ptrdiff_t(rowPitch) + z*ptrdiff_t(slicePitch)];
+    }
+    
+    unsigned getWidth() const {return width;}
+    unsigned getHeight() const {return height;}
+    unsigned getDepth() const {return depth;}
+    
+    size_t getRowPitch() const {return rowPitch;}
+    size_t getSlicePitch() const {return slicePitch;}
+
+private:
+    const T *data;
+    unsigned width, height, depth;
+    size_t rowPitch, slicePitch;
+};
+
+/**
+ * Runs Kernel<T>::run(args...) with T the voxel type of 1, 2 or 4 bytes per
+ * cell, which are unsigned integers of 8 and 16 bits or floats.
+ */
+template<template<typename> class Kernel, typename... Args>
+void dispatchVoxelType(unsigned bytesPerCell, Args&&... args)
+{
+    switch(bytesPerCell) {
+    case 4:
+        Kernel<float>::run(std::forward<Args>(args)...);
+        break;
+    case 2:
+        Kernel<uint16_t>::run(std::forward<Args>(args)...);
+        break;
+    default:
+        Kernel<uint8_t>::run(std::forward<Args>(args)...);
+    }
+}
+
+#endif // VOLUMEVIEW_H
@@ -1,7 +1,5 @@
 #include "LutWidget.h"
 
-#include <random>
-
 #include <QMouseEvent>
 #include <QPainter>
 
@@ -123,9 +121,7 @@ void LutWidget::paintEvent(QPaintEvent *e)
 
 void LutWidget::calculateHistogram()
 {
-    const unsigned count = vol->voxelCount();
-
-    if(vol->getData() == nullptr) {
+    if(!vol->hasData()) {
         return;
     }
 
@@ -133,22 +129,18 @@ void LutWidget::calculateHistogram()
         histogram[i] = 0;
     }
     
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(1, 10);
+    // the volume counts its values once, the bins of the window are folded into ours
+    const QVector<quint64> &full = vol->getHistogram();
+    const float low = vol->histogramBin(vol->getWindowLow()), high = vol->histogramBin(vol->getWindowHigh());
+    const double scale = 4096/(double(high) - low + 1);
     
-    const unsigned bitDepth = vol->getBitDepth();
-    const unsigned div = qPow(2, bitDepth);
-
-    for(unsigned i=0; i<count; i+=dis(gen)) {
-        unsigned val = (vol->densityAt(i)/double(div)) * 4096;
-        
-        histogram[val]++;
+    for(int i=qMax(0, qCeil(low)); i<=high && i<full.size(); ++i) {
+        histogram[qMin(4095, int((i - low)*scale))] += full[i];
     }
-
-    unsigned &max = histogram[4096];
+    
+    quint64 &max = histogram[4096];
     max = 0;
-
+    
     for(unsigned i=0; i<4096; ++i) {
         max = qMax(max, histogram[i]);
     }
@@ -221,6 +213,12 @@ void LutWidget::drawAxes(QPainter &p)
 void LutWidget::drawHistogram()
 {
     histogramBuffer.fill(QColor(0, 0, 0));
+    
+    // a window outside the data counts nothing, which leaves the histogram empty
+    if(histogram[4096] == 0) {
+        return;
+    }
+    
     QPainter p(&histogramBuffer);
     
     unsigned h = histogramBuffer.height();
@@ -274,6 +272,14 @@ void LutWidget::updateVolume(const Volume *vol)
     redraw();
 }
 
+void LutWidget::updateWindow()
+{
+    if(vol != nullptr) {
+        calculateHistogram();
+        redraw();
+    }
+}
+
 bool LutWidget::saveLut(const QString &filename)
 {
     QFile f(filename);
@@ -26,6 +26,7 @@ public slots:
     void resetLut();
     void updateLutRange(int x1, int x2, int y, const QColor &c);
     void updateVolume(const Volume *vol);
+    void updateWindow();
     
     bool saveLut(const QString &filename);
     bool loadLut(const QString &filename);
@@ -51,7 +52,7 @@ private:
     int lutHeight() const {return height()-2*border;}
 
     const Volume *vol = nullptr;
-    unsigned *histogram = new unsigned[4097];
+    quint64 *histogram = new quint64[4097];
     
     bool showHistogram = true;
     
@@ -5,6 +5,44 @@
 #include <qmath.h>
 #include <qendian.h>
 
+#include "VolumeView.h"
+
+namespace {
+
+/// Maps the values of a slice through the window onto gray values or the lut, row by row
+template<typename T>
+struct ColorSlice {
+    static void run(const uint8_t *slice, const Volume &vol, const uint32_t *lut, QImage &image)
+    {
+        const unsigned width = image.width(), height = image.height();
+        const float low = vol.getWindowLow(), range = vol.getWindowHigh() - low, scale = 1.f/(range > 0 ? range : 1);
+        
+        for(unsigned y=0; y<height; ++y) {
+            const T *src = (const T*)slice + size_t(y)*width;
+            QRgb *dst = (QRgb*)image.scanLine(y);
+            
+            if(lut != nullptr) {
+                for(unsigned x=0; x<width; ++x) {
+                    float value = qBound(0.f, (src[x] - low)*scale, 1.f);
+                    QRgb wColor = lut[int(value*4095)];
+                    
+                    double alpha = qAlpha(wColor)/255.;
+                    
+                    dst[x] = qRgba(qBlue(wColor)*alpha, qGreen(wColor)*alpha, qRed(wColor)*alpha, alpha*255);
+                }
+            } else {
+                for(unsigned x=0; x<width; ++x) {
+                    int val = qBound(0.f, (src[x] - low)*scale, 1.f)*255;
+                    
+                    dst[x] = qRgb(val, val, val);
+                }
+            }
+        }
+    }
+};
+
+}
+
 SliceWidget::SliceWidget(Volume &volume, QWidget *parent) :
     QWidget(parent), vol(volume)
 {
@@ -12,22 +50,42 @@ SliceWidget::SliceWidget(Volume &volume, QWidget *parent) :
     for(int i=0; i<256; ++i) {
         grayscale_lut << qRgb(i, i, i);
     }
+    
+    connect(&vol, SIGNAL(windowChanged()), this, SLOT(update()));
 }
 
 bool SliceWidget::setSlice(int z)
 {
-    slice = qBound(0, z, (int)vol.depth-1);
+    slice = qBound(0, z, (int)sliceCount()-1);
     emit sliceChanged(z);
     
     update();
     
-    if(z < 0 || z >= (int)vol.depth-1) {
+    if(z < 0 || z >= (int)sliceCount()-1) {
         return false;
     } else {
         return true;
     }
 }
 
+void SliceWidget::setAxis(int axis)
+{
+    this->axis = Volume::Axis(axis);
+    setSlice(slice);
+}
+
+unsigned SliceWidget::sliceCount() const
+{
+    switch(axis) {
+    case Volume::AXIS_X:
+        return vol.width;
+    case Volume::AXIS_Y:
+        return vol.height;
+    default:
+        return vol.depth;
+    }
+}
+
 void SliceWidget::setApplyLut(bool use)
 {
     applyLut = use;
@@ -49,44 +107,22 @@ void SliceWidget::paintEvent(QPaintEvent *e)
 {
     e->accept();
 
-    if(vol.getData() == nullptr) {
+    if(!vol.hasData()) {
         return;
     }
 
     QPainter p(this);
-
-    buffer = QImage(vol.width, vol.height, QImage::QImage::Format_ARGB32);
     
+    // rows follow x, except across x where they follow y
+    unsigned sliceWidth = axis == Volume::AXIS_X ? vol.height : vol.width;
+    unsigned sliceHeight = axis == Volume::AXIS_Z ? vol.height : vol.depth;
     
-    for(unsigned x=0; x<vol.width; ++x) {
-        for(unsigned y=0; y<vol.height; ++y) {
-            int density = vol.densityAt(x, y, slice);
-            QRgb col;
-            
-            if(applyLut) {
-                int wColor;
-                if(vol.getBytesPerCell() == 1) {
-                    wColor = lut[int(density/255.*4096)];
-                } else {
-                    wColor = lut[int(density/65536.*4096)];
-                }
-                
-                double alpha = qAlpha(wColor)/255.;
-                
-                col = qRgba(qBlue(wColor)*alpha, qGreen(wColor)*alpha, qRed(wColor)*alpha, alpha*255);
-            } else {
-                int val = density;
-                
-                if(vol.getBytesPerCell() == 2) {
-                    val = double(density/65536.)*255;
-                }
-                
-                col = qRgb(val, val, val);
-            }
-            
-            buffer.setPixel(x, y, col);
-        }
-    }
+    buffer = QImage(sliceWidth, sliceHeight, QImage::QImage::Format_ARGB32);
+    
+    sliceData.resize(size_t(sliceWidth)*sliceHeight*vol.bytesPerCell);
+    vol.extractSlice(axis, qMin(slice, sliceCount()-1), sliceData.data());
+    
+    dispatchVoxelType<ColorSlice>(vol.bytesPerCell, sliceData.data(), vol, applyLut ? lut : nullptr, buffer);
     
     p.fillRect(0, 0, width(), height(), backgroundColor);
     
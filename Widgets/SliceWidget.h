@@ -16,6 +16,7 @@ signals:
     
 public slots:
     bool setSlice(int z);
+    void setAxis(int axis);
     void setApplyLut(bool use);
     void updateLut(unsigned len, uint32_t *data);
     void setBackgroundColor(QColor color);
@@ -28,13 +29,18 @@ private:
     QVector<QRgb> grayscale_lut;
     uint32_t *lut = nullptr;
     
+    /// Number of slices across the current axis
+    unsigned sliceCount() const;
+    
     Volume &vol;
+    Volume::Axis axis = Volume::AXIS_Z;
     unsigned slice = 0;
     bool applyLut = false;
     
     QColor backgroundColor = QColor(255, 255, 255);
     
     QImage buffer;
+    vector<uint8_t> sliceData;
 };
 
 #endif // SLICEWIDGET_H
@@ -1,6 +1,9 @@
 #include <QKeyEvent>
 #include <QCoreApplication>
 
+#include <climits>
+#include <cmath>
+
 #include "VolRenderer.h"
 
 static inline void qNormalizeAngle(int &angle)
@@ -11,6 +14,40 @@ static inline void qNormalizeAngle(int &angle)
         angle -= 360 * 16;
 }
 
+/// How voxels of bytesPerCell are passed to OpenGL, 4 bytes are floats
+static inline GLenum voxelType(unsigned bytesPerCell)
+{
+    return bytesPerCell == 4 ? GL_FLOAT : bytesPerCell == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+}
+
+/// A 3D texture for volumes, the levels of the pyramid are its mipmap levels
+static GLuint createVolumeTexture()
+{
+    GLuint id;
+    glGenTextures(1, &id);
+    glBindTexture(GL_TEXTURE_3D, id);
+    
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    
+    return id;
+}
+
+/// Allocates the storage of one level of the bound volume texture, the voxels are filled in with glTexSubImage3D
+static void allocateVolumeLevel(unsigned level, unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell)
+{
+    if(bytesPerCell == 1) {
+        glTexImage3D(GL_TEXTURE_3D, level, GL_R8, width, height, depth, 0, GL_RED,
+                     GL_UNSIGNED_BYTE, nullptr);
+    } else if(bytesPerCell == 2) {
+        glTexImage3D(GL_TEXTURE_3D, level, GL_R16, width, height, depth, 0, GL_RED,
+                     GL_UNSIGNED_SHORT, nullptr);
+    } else if(bytesPerCell == 4) {
+        glTexImage3D(GL_TEXTURE_3D, level, GL_R32F, width, height, depth, 0, GL_RED,
+                     GL_FLOAT, nullptr);
+    }
+}
+
 VolRenderer::VolRenderer(const QGLFormat &f, Volume &volume, QWidget *parent)
     : QGLWidget(f, parent), vol(volume),
       rectVertexBuffer(QGLBuffer::VertexBuffer),
@@ -31,6 +68,9 @@ VolRenderer::VolRenderer(const QGLFormat &f, Volume &volume, QWidget *parent)
     connect(this, &VolRenderer::lightMoved, this, &VolRenderer::updateGL);
     
     connect(&vol, &Volume::volDataChanged, this, &VolRenderer::uploadVolumeTexture);
+    connect(&vol, &Volume::pyramidChanged, this, &VolRenderer::uploadPyramid);
+    connect(&vol, &Volume::windowChanged, this, &VolRenderer::updateOccupancy);
+    connect(&vol, &Volume::windowChanged, this, &VolRenderer::updateGL);
     
     timer = new QTimer(this);
     timer->setInterval(1);
@@ -79,9 +119,15 @@ void VolRenderer::toggleLight(bool forceOn)
     updateGL();
 }
 
-void VolRenderer::updateVolume(unsigned width, unsigned height, unsigned depth, int bitDepth, uint8_t *data)
+void VolRenderer::updateVolume(unsigned width, unsigned height, unsigned depth, int bitDepth, VolumeBuffer data,
+                               const QVector<quint64> &histogram, const QVector3D &spacing, Volume::Pyramid pyramid,
+                               Volume::Macrocells macrocells, unsigned brickSize)
 {
-    vol.setVolData(width, height, depth, bitDepth, data);
+    // the bounding box has the proportions of the physical extent, its longest side stays 1
+    QVector3D extent = QVector3D(width, height, depth)*spacing;
+    scale = extent/qMax(extent.x(), qMax(extent.y(), extent.z()));
+    
+    vol.setVolData(width, height, depth, bitDepth, move(data), histogram, move(pyramid), move(macrocells), brickSize);
     emit volumeChanged(&vol);
 }
 
@@ -89,25 +135,331 @@ void VolRenderer::initVolumeTexture()
 {
     glEnable(GL_TEXTURE_3D);
 
-    glGenTextures(1, &textureId);
+    textureId = createVolumeTexture();
+}
+
+void VolRenderer::allocateVolumeTexture(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, unsigned levels)
+{
     glBindTexture(GL_TEXTURE_3D, textureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    bool sameSize = width == textureWidth && height == textureHeight && depth == textureDepth && bytesPerCell == textureBytesPerCell;
+    
+    // allocate the storage only, levels that exist in the right size are kept
+    for(unsigned level = sameSize ? textureLevels : 0; level < levels; ++level) {
+        allocateVolumeLevel(level, qMax(1u, width >> level), qMax(1u, height >> level), qMax(1u, depth >> level), bytesPerCell);
+    }
+    
+    textureWidth = width;
+    textureHeight = height;
+    textureDepth = depth;
+    textureBytesPerCell = bytesPerCell;
+    textureLevels = sameSize ? qMax(textureLevels, levels) : levels;
+    
+    setVolumeTextureLevels(0, levels-1);
+}
 
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+void VolRenderer::setVolumeTextureLevels(unsigned baseLevel, unsigned maxLevel)
+{
+    glBindTexture(GL_TEXTURE_3D, textureId);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, baseLevel);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, maxLevel);
+}
+
+float VolRenderer::volumeLod() const
+{
+    // the longest side covers zoom*height() pixels, every level halves the voxels on it
+    unsigned longest = qMax(vol.width, qMax(vol.height, vol.depth));
+    float voxelsPerPixel = longest/(zoom*qMax(1, height()));
+    
+    return qMax(0.f, float(std::log2(voxelsPerPixel)));
+}
+
+void VolRenderer::beginVolumeUpload(unsigned width, unsigned height, unsigned depth, int bitDepth)
+{
+    makeCurrent();
+    
+    streamWidth = width;
+    streamHeight = height;
+    streamDepth = depth;
+    streamBytesPerCell = qCeil(bitDepth/8.);
+    streamedSlices = 0;
+    
+    // the slabs go into a texture of their own, the one that is shown keeps the current volume until the load is finished
+    if(streamTextureId == 0) {
+        streamTextureId = createVolumeTexture();
+    }
+    
+    glBindTexture(GL_TEXTURE_3D, streamTextureId);
+    allocateVolumeLevel(0, width, height, depth, streamBytesPerCell);
+    
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+void VolRenderer::uploadVolumeSlab(unsigned z, unsigned depth, const uint8_t *data)
+{
+    makeCurrent();
+    
+    glBindTexture(GL_TEXTURE_3D, streamTextureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, z, streamWidth, streamHeight, depth, GL_RED,
+                    voxelType(streamBytesPerCell), data);
+    
+    streamedSlices += depth;
+}
+
+void VolRenderer::cancelVolumeUpload()
+{
+    streamWidth = streamHeight = streamDepth = 0;
+    streamedSlices = 0;
+    
+    // the texture that is shown was never touched
+    if(streamTextureId != 0) {
+        makeCurrent();
+        glDeleteTextures(1, &streamTextureId);
+        streamTextureId = 0;
+    }
 }
 
 void VolRenderer::uploadVolumeTexture()
 {
+    volumeInTexture = true;
+    updateOccupancy();
+    
+    bool streamed = streamTextureId != 0 && streamedSlices == vol.depth && streamWidth == vol.width && streamHeight == vol.height
+            && streamDepth == vol.depth && streamBytesPerCell == vol.bytesPerCell;
+    
+    if(streamed) {
+        // the loader filled the full level of a texture of its own, it replaces the one of the previous volume
+        makeCurrent();
+        glDeleteTextures(1, &textureId);
+        textureId = streamTextureId;
+        streamTextureId = 0;
+        streamedSlices = 0;
+        
+        textureWidth = vol.width;
+        textureHeight = vol.height;
+        textureDepth = vol.depth;
+        textureBytesPerCell = vol.bytesPerCell;
+        textureLevels = 1;
+    }
+    
+    glBindTexture(GL_TEXTURE_3D, textureId);
+    
+    qDebug() << vol.volData.data();
+    
+    const Volume::Pyramid &pyramid = vol.pyramid;
+    unsigned levels = pyramid.size() + 1;
+    
+    allocateVolumeTexture(vol.width, vol.height, vol.depth, vol.bytesPerCell, levels);
+    uploadPyramidLevels();
+    
+    fullLevelPending = !streamed;
+    
+    if(streamed) {
+        // the loader already put every slab into the texture
+        return;
+    } else if(pyramid.empty()) {
+        uploadFullLevel();
+        return;
+    }
+    
+    // draw a frame from the pyramid, the full level follows once the event loop is back
+    setVolumeTextureLevels(1, levels-1);
+    updateGL();
+    
+    QTimer::singleShot(0, this, SLOT(uploadFullLevel()));
+}
+
+void VolRenderer::uploadPyramid()
+{
+    // a sequence owns the texture
+    if(!volumeInTexture) {
+        return;
+    }
+    
+    makeCurrent();
+    
+    // the full level is kept, the storage of the others is added
+    unsigned levels = vol.pyramid.size() + 1;
+    allocateVolumeTexture(vol.width, vol.height, vol.depth, vol.bytesPerCell, levels);
+    uploadPyramidLevels();
+    
+    if(fullLevelPending && levels > 1) {
+        setVolumeTextureLevels(1, levels-1);
+    }
+    
+    updateGL();
+}
+
+void VolRenderer::uploadPyramidLevels()
+{
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    // coarsest first, a fraction of the full level that can be shown right away
+    for(unsigned level = vol.pyramid.size(); level > 0; --level) {
+        const Volume::Level &l = vol.pyramid[level-1];
+        
+        glTexSubImage3D(GL_TEXTURE_3D, level, 0, 0, 0, l.width, l.height, l.depth, GL_RED,
+                        voxelType(vol.bytesPerCell), l.data.data());
+    }
+}
+
+void VolRenderer::uploadFullLevel()
+{
+    // a sequence or another volume may have taken over the texture in the meantime
+    if(!fullLevelPending || !vol.hasData()) {
+        return;
+    }
+    
+    fullLevelPending = false;
+    
+    makeCurrent();
+    
+    glBindTexture(GL_TEXTURE_3D, textureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    
+    GLenum type = voxelType(vol.bytesPerCell);
+    
+    if(vol.getBrickSize() == 0) {
+        glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, vol.width, vol.height, vol.depth, GL_RED, type, vol.volData.data());
+    } else {
+        // one box per brick, the pitches step over the apron
+        for(size_t i=0; i<vol.brickCount(); ++i) {
+            Volume::Brick brick = vol.getBrick(i);
+            
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, brick.rowPitch);
+            glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, brick.slicePitch/brick.rowPitch);
+            
+            glTexSubImage3D(GL_TEXTURE_3D, 0, brick.x, brick.y, brick.z, brick.width, brick.height, brick.depth, GL_RED, type, brick.data);
+        }
+        
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_IMAGE_HEIGHT, 0);
+    }
+    
+    setVolumeTextureLevels(0, vol.pyramid.size());
+    updateGL();
+}
+
+void VolRenderer::beginSequence(unsigned width, unsigned height, unsigned depth, int bitDepth)
+{
+    makeCurrent();
+    
+    sequenceWidth = width;
+    sequenceHeight = height;
+    sequenceDepth = depth;
+    sequenceBytesPerCell = qCeil(bitDepth/8.);
+    
+    // the macrocells describe frame 0 only
+    volumeInTexture = occupancyValid = false;
+    
+    // frames only replace the full level, which has to hold frame 0 until the next one is there
+    uploadFullLevel();
+    
+    qint64 frameBytes = qint64(width)*height*depth*sequenceBytesPerCell;
+    
+    allocateVolumeTexture(width, height, depth, sequenceBytesPerCell);
+    
+    for(QGLBuffer &buffer : pixelBuffers) {
+        buffer = QGLBuffer(QGLBuffer::PixelUnpackBuffer);
+        buffer.setUsagePattern(QGLBuffer::StreamDraw);
+        
+        // QGLBuffer sizes are ints, bigger frames are uploaded from client memory
+        if(frameBytes > INT_MAX || !buffer.create()) {
+            buffer.destroy();
+            sequenceFrame.resize(frameBytes);
+            break;
+        }
+    }
+    
+    pixelBufferIndex = 0;
+    mappedPixelBuffer = -1;
+}
+
+uint8_t *VolRenderer::mapSequenceFrame()
+{
+    QGLBuffer &buffer = pixelBuffers[pixelBufferIndex];
+    
+    if(!buffer.isCreated()) {
+        return (uint8_t*)sequenceFrame.data();
+    }
+    
+    makeCurrent();
+    
+    buffer.bind();
+    
+    // fresh storage, so mapping never waits for a transfer that still reads the old one
+    buffer.allocate(sequenceWidth*sequenceHeight*sequenceDepth*sequenceBytesPerCell);
+    uint8_t *data = (uint8_t*)buffer.map(QGLBuffer::WriteOnly);
+    
+    if(data != nullptr) {
+        mappedPixelBuffer = pixelBufferIndex;
+    }
+    
+    buffer.release();
+    
+    return data;
+}
+
+void VolRenderer::presentSequenceFrame()
+{
+    makeCurrent();
+    
+    QGLBuffer &buffer = pixelBuffers[pixelBufferIndex];
+    const uint8_t *pixels = (const uint8_t*)sequenceFrame.constData();
+    
+    if(buffer.isCreated()) {
+        buffer.bind();
+        buffer.unmap();
+        mappedPixelBuffer = -1;
+        
+        // the pixels are read from the bound buffer, asynchronously
+        pixels = nullptr;
+    }
+    
     glBindTexture(GL_TEXTURE_3D, textureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     
-    qDebug() << vol.volData;
+    glTexSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, sequenceWidth, sequenceHeight, sequenceDepth, GL_RED,
+                    voxelType(sequenceBytesPerCell), pixels);
     
-    if(vol.bytesPerCell == 1) {
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_R8, vol.width, vol.height, vol.depth, 0, GL_RED,
-                     GL_UNSIGNED_BYTE, vol.volData);
-    } else if(vol.bytesPerCell == 2) {
-        glTexImage3D(GL_TEXTURE_3D, 0, GL_R16, vol.width, vol.height, vol.depth, 0, GL_RED,
-                     GL_UNSIGNED_SHORT, vol.volData);
+    if(buffer.isCreated()) {
+        buffer.release();
+    }
+    
+    pixelBufferIndex = (pixelBufferIndex + 1) % 2;
+    
+    updateGL();
+}
+
+void VolRenderer::endSequence()
+{
+    makeCurrent();
+    
+    // only the buffer of the prefetched frame is mapped
+    if(mappedPixelBuffer >= 0) {
+        pixelBuffers[mappedPixelBuffer].bind();
+        pixelBuffers[mappedPixelBuffer].unmap();
+        pixelBuffers[mappedPixelBuffer].release();
+        mappedPixelBuffer = -1;
+    }
+    
+    for(QGLBuffer &buffer : pixelBuffers) {
+        if(buffer.isCreated()) {
+            buffer.destroy();
+        }
+    }
+    
+    sequenceFrame.clear();
+    sequenceWidth = sequenceHeight = sequenceDepth = sequenceBytesPerCell = 0;
+    
+    // show the loaded volume again
+    if(vol.hasData()) {
+        uploadVolumeTexture();
+        updateGL();
     }
 }
 
@@ -122,6 +474,67 @@ void VolRenderer::uploadLutTexture(int len)
     glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, len, 0, GL_RGBA, GL_UNSIGNED_BYTE, lut);
 }
 
+void VolRenderer::updateOccupancy()
+{
+    occupancyValid = false;
+    
+    const Volume::Macrocells &cells = vol.getMacrocells();
+    
+    if(!volumeInTexture || lut == nullptr || cells.empty()) {
+        return;
+    }
+    
+    // how many lut entries up to each one are visible, to tell in one step if any in a range is
+    vector<unsigned> visible(lutLength + 1, 0);
+    
+    for(unsigned i=0; i<lutLength; ++i) {
+        visible[i+1] = visible[i] + (qAlpha(lut[i]) > 0 ? 1 : 0);
+    }
+    
+    // the lut is sampled linearly and wraps around, so the entries on either side count too
+    auto anyVisible = [&](int first, int last) {
+        bool wraps = first < 0 || last >= int(lutLength);
+        first = qBound(0, first, int(lutLength)-1);
+        last = qBound(0, last, int(lutLength)-1);
+        
+        return visible[last+1] > visible[first] || (wraps && (qAlpha(lut[0]) > 0 || qAlpha(lut[lutLength-1]) > 0));
+    };
+    
+    unsigned cellsX, cellsY, cellsZ;
+    vol.getMacrocellCount(cellsX, cellsY, cellsZ);
+    
+    // r is exact for full resolution, g also covers the neighbouring cells that coarser levels blur into
+    vector<uint8_t> occupancy(cells.size()*2);
+    
+    for(size_t i=0; i<cells.size(); ++i) {
+        float low = vol.applyWindow(cells[i].min)*lutLength - .5f, high = vol.applyWindow(cells[i].max)*lutLength - .5f;
+        occupancy[i*2] = anyVisible(int(std::floor(low)) - 1, int(std::floor(high)) + 2) ? 255 : 0;
+    }
+    
+    for(size_t i=0; i<cells.size(); ++i) {
+        int x = i % cellsX, y = i / cellsX % cellsY, z = i / cellsX / cellsY;
+        uint8_t any = 0;
+        
+        for(int dz = qMax(0, z-1); dz <= qMin(int(cellsZ)-1, z+1); ++dz) {
+            for(int dy = qMax(0, y-1); dy <= qMin(int(cellsY)-1, y+1); ++dy) {
+                for(int dx = qMax(0, x-1); dx <= qMin(int(cellsX)-1, x+1); ++dx) {
+                    any |= occupancy[((size_t(dz)*cellsY + dy)*cellsX + dx)*2];
+                }
+            }
+        }
+        
+        occupancy[i*2+1] = any;
+    }
+    
+    makeCurrent();
+    
+    glBindTexture(GL_TEXTURE_3D, occupancyTextureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RG8, cellsX, cellsY, cellsZ, 0, GL_RG, GL_UNSIGNED_BYTE, occupancy.data());
+    
+    occupancyValid = true;
+}
+
 void VolRenderer::updateLight()
 {
     raycastShader.bind();
@@ -146,6 +559,18 @@ void VolRenderer::initLutTexture()
     glBindTexture(GL_TEXTURE_1D, lutTextureId);
 }
 
+void VolRenderer::initOccupancyTexture()
+{
+    glGenTextures(1, &occupancyTextureId);
+    glBindTexture(GL_TEXTURE_3D, occupancyTextureId);
+    
+    // one texel per macrocell, read with texelFetch
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
 void VolRenderer::initVertexArrayObjects()
 {
     uint vao;
@@ -299,6 +724,7 @@ void VolRenderer::initializeGL()
     cubeVertexBuffer.release();
     
     initVolumeTexture();
+    initOccupancyTexture();
     
     uploadLutTexture();
     
@@ -308,6 +734,7 @@ void VolRenderer::initializeGL()
     raycastShader.setUniformValue("volData", 0);
     raycastShader.setUniformValue("ray", 1);
     raycastShader.setUniformValue("lut", 2);
+    raycastShader.setUniformValue("occupancy", 5);
     
     raycastShader.setUniformValue("width", vol.width);
     raycastShader.setUniformValue("depth", vol.depth);
@@ -394,6 +821,9 @@ void VolRenderer::raycast()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     
+    glActiveTexture(GL_TEXTURE5);
+    glBindTexture(GL_TEXTURE_3D, occupancyTextureId);
+    
     
     raycastShader.setUniformValue("stepsize", stepsize);
     raycastShader.setUniformValue("rayDithering", rayDithering);
@@ -405,6 +835,19 @@ void VolRenderer::raycast()
     raycastShader.setUniformValue("height", vol.height);
     raycastShader.setUniformValue("depth", vol.depth);
     
+    float lod = volumeLod();
+    raycastShader.setUniformValue("lod", lod);
+    
+    // the exact cells hold for full resolution, up to level 2 the blur stays within the neighbouring cells
+    int skipping = !occupancyValid || lod > 2 ? 0 : lod == 0 ? 1 : 2;
+    raycastShader.setUniformValue("emptySpaceSkipping", skipping);
+    raycastShader.setUniformValue("macrocellSize", int(Volume::macrocellSize));
+    
+    // integer textures hold the stored values normalized to their format, floats as they are. The window is applied while sampling
+    float valueMax = vol.hasFloatValues() ? 1 : (1u << 8*vol.bytesPerCell) - 1;
+    raycastShader.setUniformValue("windowLow", vol.windowLow/valueMax);
+    raycastShader.setUniformValue("windowHigh", vol.windowHigh/valueMax);
+    
     raycastShader.setUniformValue("backgroundColor", backgroundColor);
     
     raycastShader.setUniformValue("front", 3);
@@ -433,7 +876,7 @@ void VolRenderer::raycast()
 
 void VolRenderer::paintGL()
 {
-    if(vol.getData() == nullptr || !isEnabled() || !isVisible())
+    if(!vol.hasData() || !isEnabled() || !isVisible())
     {
         glClear(GL_COLOR_BUFFER_BIT);
         return;
@@ -537,7 +980,9 @@ void VolRenderer::calculateFPS()
 void VolRenderer::updateLut(unsigned len, uint32_t *data)
 {
     lut = data;
+    lutLength = len;
     uploadLutTexture(len);
+    updateOccupancy();
     updateGL();
 }
 
@@ -40,7 +40,19 @@ public slots:
     
     void toggleLight(bool forceOn);
     
-    void updateVolume(unsigned width, unsigned height, unsigned depth, int bitDepth, uint8_t *data);
+    void updateVolume(unsigned width, unsigned height, unsigned depth, int bitDepth, VolumeBuffer data,
+                      const QVector<quint64> &histogram = QVector<quint64>(), const QVector3D &spacing = QVector3D(1, 1, 1),
+                      Volume::Pyramid pyramid = Volume::Pyramid(), Volume::Macrocells macrocells = Volume::Macrocells(),
+                      unsigned brickSize = 0);
+    void beginVolumeUpload(unsigned width, unsigned height, unsigned depth, int bitDepth);
+    void uploadVolumeSlab(unsigned z, unsigned depth, const uint8_t *data);
+    void cancelVolumeUpload();
+    
+    void beginSequence(unsigned width, unsigned height, unsigned depth, int bitDepth);
+    uint8_t *mapSequenceFrame();
+    void presentSequenceFrame();
+    void endSequence();
+    
     void updateLut(unsigned len, uint32_t *data);
     void setStepsize(double stepsize);
     
@@ -77,7 +89,10 @@ protected:
     
 private slots:
     void uploadVolumeTexture();
+    void uploadPyramid();
+    void uploadFullLevel();
     void uploadLutTexture(int len = 256);
+    void updateOccupancy();
     
     void updateLight();
     
@@ -89,7 +104,12 @@ private:
     bool loadShader(QGLShaderProgram &raycastShader, const QString &vertexShaderPath, const QString &fragmentShaderPath);
 
     void initVolumeTexture();
+    void allocateVolumeTexture(unsigned width, unsigned height, unsigned depth, unsigned bytesPerCell, unsigned levels = 1);
+    void setVolumeTextureLevels(unsigned baseLevel, unsigned maxLevel);
+    void uploadPyramidLevels();
+    float volumeLod() const;
     void initLutTexture();
+    void initOccupancyTexture();
     
     void initVertexArrayObjects();
     
@@ -120,9 +140,34 @@ private:
     LightSource light;
     
     uint32_t *lut = nullptr;
+    unsigned lutLength = 256;
 
     unsigned textureId;
+    
+    // dimensions and progress of a volume that is streamed slab by slab into a texture of its own, 0 if there is none
+    unsigned streamTextureId = 0;
+    unsigned streamWidth = 0, streamHeight = 0, streamDepth = 0, streamBytesPerCell = 0;
+    unsigned streamedSlices = 0;
+    
+    // what the storage of the volume texture was created for, it's only reallocated if that changes
+    unsigned textureWidth = 0, textureHeight = 0, textureDepth = 0, textureBytesPerCell = 0;
+    unsigned textureLevels = 0;
+    
+    // the pyramid is shown until the full resolution level follows after the next frame
+    bool fullLevelPending = false;
+    
+    // frames of a sequence are written into one pixel buffer while the other one is copied into the texture
+    QGLBuffer pixelBuffers[2];
+    unsigned pixelBufferIndex = 0;
+    int mappedPixelBuffer = -1;
+    QByteArray sequenceFrame;
+    unsigned sequenceWidth = 0, sequenceHeight = 0, sequenceDepth = 0, sequenceBytesPerCell = 0;
     unsigned lutTextureId;
+    
+    // which macrocells the lut leaves visible, only valid while the texture holds the voxels of vol
+    unsigned occupancyTextureId;
+    bool volumeInTexture = false;
+    bool occupancyValid = false;
 
     QGLShaderProgram raycastShader;
     QGLShaderProgram directionShader;
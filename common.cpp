@@ -1,5 +1,9 @@
 #include "common.h"
 
+#include <QThread>
+#include <QVector>
+#include <QtConcurrent>
+
 void print_binary(uint8_t a)
 {
     bitset<sizeof(a)*8> x(a);
@@ -14,6 +18,43 @@ void print_binary(unsigned a)
     cout << x << endl;
 }
 
+void parallelFor(size_t count, const function<void(size_t, size_t)> &fn, size_t minChunk)
+{
+    size_t threads = qMax(1, QThread::idealThreadCount());
+    size_t chunks = qMin(threads, (count + minChunk-1)/minChunk);
+    
+    if(chunks <= 1) {
+        if(count > 0) {
+            fn(0, count);
+        }
+        
+        return;
+    }
+    
+    // ranges of voxels keep their borders on cache line multiples, few large items like slices are split evenly
+    const bool alignBorders = minChunk >= 64;
+    const size_t chunkSize = ((count + chunks-1)/chunks + 63) & ~size_t(63);
+    
+    auto border = [&](size_t chunk) {
+        return alignBorders ? qMin(count, chunk*chunkSize) : count*chunk/chunks;
+    };
+    
+    QVector<QFuture<void>> futures;
+    
+    for(size_t chunk=1; chunk<chunks && border(chunk) < count; ++chunk) {
+        size_t begin = border(chunk), end = border(chunk+1);
+        
+        futures.append(QtConcurrent::run([&fn, begin, end]() {
+            fn(begin, end);
+        }));
+    }
+    
+    fn(0, border(1));
+    
+    for(QFuture<void> &f : futures) {
+        f.waitForFinished();
+    }
+}
 
 void StopWatch::start()
 {
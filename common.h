@@ -4,6 +4,7 @@
 #include <bitset>
 #include <iostream>
 #include <chrono>
+#include <functional>
 
 #include <cstdint>
 
@@ -15,9 +16,12 @@
 
 #include "Formats/DDSLoader.h"
 #include "Formats/RawLoader.h"
+#include "Formats/NrrdLoader.h"
+#include "Formats/MetaImageLoader.h"
 
 #ifdef USE_DICOM
 #include "Formats/DicomLoader.h"
+#include "Formats/DicomSeriesLoader.h"
 #endif
 
 using namespace std;
@@ -47,6 +51,12 @@ constexpr int operator "" _b() {
 void print_binary(uint8_t a);
 void print_binary(unsigned a);
 
+/**
+ * Splits [0, count) into one contiguous range per core and calls fn(begin, end)
+ * for each of them in parallel. Returns once all ranges are processed.
+ */
+void parallelFor(size_t count, const function<void(size_t begin, size_t end)> &fn, size_t minChunk = 1<<16);
+
 class StopWatch {
 public:
     void start();
@@ -3,11 +3,24 @@
 uniform sampler3D volData;
 uniform sampler1D lut;
 
+// per macrocell whether the lut leaves anything visible, r exactly, g including the neighbouring cells
+uniform sampler3D occupancy;
+
 uniform sampler2D front;
 uniform sampler2D back;
 
 uniform int width, height, depth;
 
+// mipmap level of volData, higher when the volume is zoomed out
+uniform float lod = 0;
+
+// the values of volData spread over the lut
+uniform float windowLow = 0, windowHigh = 1;
+
+// 0 samples every step, 1 skips the cells empty in r, 2 the ones empty in g
+uniform int emptySpaceSkipping = 0;
+uniform int macrocellSize = 16;
+
 uniform vec3 volumePosition;
 
 uniform float stepsize;
@@ -32,14 +45,22 @@ struct LightSource {
 
 uniform LightSource light;
 
+/**
+ * Map a value of volData onto the lut
+ */
+float applyWindow(float value)
+{
+    return clamp((value - windowLow) / max(windowHigh - windowLow, 1e-6), 0.0, 1.0);
+}
+
 /**
  * Calculate the gradient at pos with delta d 
  */
 vec3 grad(vec3 pos, vec3 d)
 {
-    float dx = texture(volData, vec3(pos.x+d.x, pos.y, pos.z)).r - texture(volData, vec3(pos.x-d.x, pos.y, pos.z)).r;
-    float dy = texture(volData, vec3(pos.x, pos.y+d.y, pos.z)).r - texture(volData, vec3(pos.x, pos.y-d.y, pos.z)).r;
-    float dz = texture(volData, vec3(pos.x, pos.y, pos.z+d.z)).r - texture(volData, vec3(pos.x, pos.y, pos.z-d.z)).r;
+    float dx = textureLod(volData, vec3(pos.x+d.x, pos.y, pos.z), lod).r - textureLod(volData, vec3(pos.x-d.x, pos.y, pos.z), lod).r;
+    float dy = textureLod(volData, vec3(pos.x, pos.y+d.y, pos.z), lod).r - textureLod(volData, vec3(pos.x, pos.y-d.y, pos.z), lod).r;
+    float dz = textureLod(volData, vec3(pos.x, pos.y, pos.z+d.z), lod).r - textureLod(volData, vec3(pos.x, pos.y, pos.z-d.z), lod).r;
     
     return vec3(dx, dy, dz)*.5;
 }
@@ -111,18 +132,41 @@ vec3 raycast(const bool front2back)
     vec4 voxel;
     vec4 color_sample;
     
-    vec3 normal_delta = vec3(1.0/width, 1.0/height, 1.0/depth);
+    vec3 normal_delta = exp2(lod)/vec3(width, height, depth);
     //vec3 normal_delta = vec3(0.005);
     
     vec3 pos = start;
     
     int steps = int(len/stepsize);
     
+    vec3 size = vec3(width, height, depth);
+    ivec3 lastCell = textureSize(occupancy, 0) - 1;
+    
     vec3 normal;
     for(int i = 0; i < steps; ++i)
     {
-        voxel = texture(volData, pos);
-        color_sample = texture(lut, voxel.r); // voxel.r = density
+        if(emptySpaceSkipping != 0) {
+            ivec3 cell = min(ivec3(clamp(pos, 0.0, 1.0)*size)/macrocellSize, lastCell);
+            vec2 occupied = texelFetch(occupancy, cell, 0).rg;
+            
+            if((emptySpaceSkipping == 1 ? occupied.r : occupied.g) == 0) {
+                // on to the first sample past the cell, samples stay where they would have been
+                vec3 exit = mix(vec3(cell), vec3(cell + 1), greaterThan(step, vec3(0)))*float(macrocellSize)/size;
+                vec3 distances = abs(exit - pos)/max(abs(step), vec3(1e-9));
+                float skip = max(1.0, ceil(min(distances.x, min(distances.y, distances.z))));
+                
+                pos += step*skip;
+                len_acc += stepsize*skip;
+                i += int(skip) - 1;
+                
+                if(len_acc >= len) break;
+                
+                continue;
+            }
+        }
+        
+        voxel = textureLod(volData, pos, lod);
+        color_sample = texture(lut, applyWindow(voxel.r)); // voxel.r = density
         
         pos += step;
         len_acc += stepsize;
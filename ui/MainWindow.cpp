@@ -4,10 +4,18 @@
 #include "OpenWizard.h"
 
 #include <QColorDialog>
+#include <QMessageBox>
+#include <QtConcurrent>
+
+#include <cmath>
 
 #include "Formats/Loader.h"
+#include "Formats/DDSCodec.h"
 #include "Formats/DDSLoader.h"
 #include "Formats/RawLoader.h"
+#include "Formats/NrrdLoader.h"
+#include "Formats/MetaImageLoader.h"
+#include "Formats/VolumeCache.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -70,6 +78,11 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(glw, &VolRenderer::volumeChanged, this, &MainWindow::updateVolumeInfo);
     connect(glw, &VolRenderer::volumeChanged, ui->lut, &LutWidget::updateVolume);
     
+    connect(vol, &Volume::windowChanged, ui->lut, &LutWidget::updateWindow);
+    connect(vol, &Volume::windowChanged, this, &MainWindow::updateWindowControls);
+    connect(ui->windowLevelSpinBox, SIGNAL(valueChanged(double)), this, SLOT(updateWindow()));
+    connect(ui->windowWidthSpinBox, SIGNAL(valueChanged(double)), this, SLOT(updateWindow()));
+    
     connect(slw, &SliceWidget::sliceChanged, ui->sliceSpinBox, &QSpinBox::setValue);
     connect(ui->sliceSpinBox, SIGNAL(valueChanged(int)), slw, SLOT(setSlice(int)));
     
@@ -82,6 +95,17 @@ MainWindow::MainWindow(QWidget *parent) :
     
     connect(fpsTimer, &QTimer::timeout,this, &MainWindow::updateFPS);
     
+    loadWatcher = new QFutureWatcher<shared_ptr<LoadResult>>(this);
+    connect(loadWatcher, &QFutureWatcher<shared_ptr<LoadResult>>::finished, this, &MainWindow::finishLoading);
+    connect(this, &MainWindow::loadProgressed, this, &MainWindow::updateLoadProgress);
+    
+    pyramidWatcher = new QFutureWatcher<shared_ptr<PyramidResult>>(this);
+    connect(pyramidWatcher, &QFutureWatcher<shared_ptr<PyramidResult>>::finished, this, &MainWindow::finishPyramid);
+    
+    // streamed slabs are only valid during the callback, so the loading thread waits for the upload
+    qRegisterMetaType<const uint8_t*>("const uint8_t*");
+    connect(this, &MainWindow::slabLoaded, glw, &VolRenderer::uploadVolumeSlab, Qt::BlockingQueuedConnection);
+    
     QTimer::singleShot(150, this, SLOT(init()));
 }
 
@@ -161,7 +185,7 @@ void MainWindow::updateLightPos(const QVector3D &pos)
 void MainWindow::updateVolumeInfo(const Volume *vol)
 {
     unsigned width = vol->getWidth(), height = vol->getHeight(), depth = vol->getDepth();
-    unsigned bytesDensities = width*height*depth;
+    qint64 bytesDensities = qint64(width)*height*depth*vol->getBytesPerCell();
     
     ui->volWidth ->setText(QString("%L1px").arg(width));
     ui->volHeight->setText(QString("%L1px").arg(height));
@@ -170,8 +194,22 @@ void MainWindow::updateVolumeInfo(const Volume *vol)
     ui->memoryDensities   ->setText(QString("%L1 Byte").arg(bytesDensities));
     ui->memoryDensitiesMiB->setText(QString("%L1 MiB").arg(bytesDensities/1024./1024., 16, 'f', 2));
     
+    // the window is in the units of the values, floats are stepped through in hundredths of their range
+    bool floats = vol->hasFloatValues();
+    double step = floats ? qMax(1e-6, (vol->getValueMax() - vol->getValueMin())/100.) : 1;
+    
+    QDoubleSpinBox *spinBoxes[] = {ui->windowLevelSpinBox, ui->windowWidthSpinBox};
+    const double minimums[] = {floats ? -1e30 : 0, floats ? 0 : 1};
     
-    ui->sliceSpinBox->setMaximum(depth);
+    for(int i=0; i<2; ++i) {
+        spinBoxes[i]->blockSignals(true);
+        spinBoxes[i]->setDecimals(floats ? qMax(0, 2 - qFloor(std::log10(step))) : 0);
+        spinBoxes[i]->setSingleStep(step);
+        spinBoxes[i]->setRange(minimums[i], floats ? 1e30 : 65535);
+        spinBoxes[i]->blockSignals(false);
+    }
+    
+    on_sliceAxis_currentIndexChanged(ui->sliceAxis->currentIndex());
 }
 
 void MainWindow::updateFPS()
@@ -203,6 +241,23 @@ QColor MainWindow::showColorChooser(QLineEdit &e)
 
 MainWindow::~MainWindow()
 {
+    if(loader != nullptr) {
+        loader->cancel();
+        
+        // the loading thread might wait for a slab upload, keep serving events until it gave up
+        while(loadWatcher->isRunning()) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+        
+        if(loader != nullptr) {
+            finishLoading();
+        }
+    }
+    
+    // the cache may still be written
+    pyramidWatcher->waitForFinished();
+    
+    delete sequence;
     delete ui;
 }
 
@@ -275,51 +330,436 @@ void MainWindow::on_loadFileButton_clicked()
     w.exec();
     QString filename = w.getFilename();
     
-    if(!filename.isEmpty()) {
-        Loader *loader = nullptr;
+    centralWidget()->setDisabled(false);
+    
+    if(filename.isEmpty()) {
+        return;
+    }
+    
+    streaming = false;
+    
+    // a new volume ends the sequence that was playing
+    delete sequence;
+    sequence = nullptr;
+    
+    ui->playSequenceButton->setChecked(false);
+    ui->playSequenceButton->setEnabled(false);
+    ui->sequenceFpsSpinBox->setEnabled(false);
+    ui->sequenceFrameLabel->clear();
+    
+    switch(w.getFormat()) {
+    case OpenWizard::Loader::Loader_RawSequence:
+        sequence = new SequencePlayer(glw, this);
         
-        switch(w.getFormat()) {
-        case OpenWizard::Loader::Loader_RAW: {
-            loader = new RawLoader();
-            RawLoader *rl = (RawLoader*)loader;
+        if(!sequence->open(filename, w.getRawWidth(), w.getRawHeight(), w.getRawDepth(), w.getRawBitdepth(),
+                           (Loader::ByteOrder)w.getByteOrder(), w.getRawNormalize())) {
+            QMessageBox::warning(this, "Loading failed", sequence->errorString());
             
-            rl->setWidth(w.getRawWidth());
-            rl->setHeight(w.getRawHeight());
-            rl->setDepth(w.getRawDepth());
+            delete sequence;
+            sequence = nullptr;
             
-            rl->setBitDepth(w.getRawBitdepth());
-            rl->setByteOrder((Loader::ByteOrder)w.getByteOrder());
-            rl->setLinearize(w.getRawNormalize());
-            
-            break;
+            return;
         }
+        
+        sequence->setFrameRate(ui->sequenceFpsSpinBox->value());
+        
+        connect(ui->sequenceFpsSpinBox, SIGNAL(valueChanged(double)), sequence, SLOT(setFrameRate(double)));
+        connect(sequence, &SequencePlayer::frameChanged, this, &MainWindow::updateSequenceFrame);
+        connect(sequence, &SequencePlayer::failed, this, &MainWindow::sequenceFailed);
+        
+        // frame 0 is loaded like a single raw volume, the others are read while playing
+        filename = sequence->firstFile();
+        
+        // fall through
+    case OpenWizard::Loader::Loader_RAW: {
+        loader = new RawLoader();
+        RawLoader *rl = (RawLoader*)loader;
+        
+        rl->setWidth(w.getRawWidth());
+        rl->setHeight(w.getRawHeight());
+        rl->setDepth(w.getRawDepth());
+        
+        rl->setBitDepth(w.getRawBitdepth());
+        rl->setByteOrder((Loader::ByteOrder)w.getByteOrder());
+        rl->setLinearize(w.getRawNormalize());
+        rl->setIOMode((RawLoader::IOMode)w.getRawIOMode());
+        
+        if(w.getFormat() == OpenWizard::Loader::Loader_RAW) {
+            unsigned x, y, z, width, height, depth;
             
-        case OpenWizard::Loader::Loader_DDS: {
-            loader = new DDSLoader();
+            w.getRawRegion(x, y, z, width, height, depth);
+            rl->setRegion(x, y, z, width, height, depth);
             
-            break;
+            w.getRawStride(x, y, z);
+            rl->setStride(x, y, z);
         }
-            
-        #ifdef USE_DICOM
-        case OpenWizard::Loader::Loader_Dicom: {
-            loader = new DicomLoader();
+        
+        // a region is gathered row by row and can't be streamed
+        if(w.getRawIOMode() == RawLoader::IOMode::IO_STREAM && !rl->hasRegion()) {
+            // hand every finished slab to the texture while the rest is still being read
+            streaming = true;
+            glw->beginVolumeUpload(w.getRawWidth(), w.getRawHeight(), w.getRawDepth(), qCeil(w.getRawBitdepth()/8.)*8);
+            rl->setSlabCallback([this](unsigned z, unsigned depth, const uint8_t *data) {
+                emit slabLoaded(z, depth, data);
+            });
+        }
+        
+        break;
+    }
+    
+    case OpenWizard::Loader::Loader_DDS: {
+        loader = new DDSLoader();
+        
+        break;
+    }
+    
+    case OpenWizard::Loader::Loader_NRRD: {
+        loader = new NrrdLoader();
+        
+        break;
+    }
+    
+    case OpenWizard::Loader::Loader_MetaImage: {
+        loader = new MetaImageLoader();
+        
+        break;
+    }
+    
+    #ifdef USE_DICOM
+    case OpenWizard::Loader::Loader_Dicom: {
+        loader = new DicomLoader();
+        
+        break;
+    }
+    
+    case OpenWizard::Loader::Loader_DicomSeries: {
+        loader = new DicomSeriesLoader();
+        
+        break;
+    }
+    #endif
+    }
+    
+    if(loader == nullptr) {
+        return;
+    }
+    
+    loader->setProgressCallback([this](qint64 done, qint64 total, const QString &stage) {
+        emit loadProgressed(done, total, stage);
+    });
+    
+    // the current volume stays usable while the next one loads
+    loadProgress = new QProgressDialog(QString("Loading %1").arg(QFileInfo(filename).fileName()), "Cancel", 0, 1000, this);
+    loadProgress->setAutoReset(false);
+    loadProgress->setAutoClose(false);
+    loadProgress->setMinimumDuration(500);
+    
+    connect(loadProgress, &QProgressDialog::canceled, [this]() {
+        loader->cancel();
+    });
+    
+    ui->loadFileButton->setEnabled(false);
+    
+    bool useCache = w.getUseCache();
+    unsigned brickSize = ui->brickedLayout->isChecked() ? 32 : 0;
+    
+    loadWatcher->setFuture(QtConcurrent::run([this, filename, useCache, brickSize]() {
+        return load(filename, useCache, brickSize);
+    }));
+}
 
-            break;
+shared_ptr<MainWindow::LoadResult> MainWindow::load(const QString &filename, bool useCache, unsigned brickSize)
+{
+    shared_ptr<LoadResult> loaded = make_shared<LoadResult>();
+    LoadResult &result = *loaded;
+    VolumeCache cache;
+    
+    // detached data and the slices of a series change without their header or directory
+    const QStringList dataFiles = useCache ? loader->dataFiles(filename) : QStringList();
+    
+    if(useCache && cache.open(filename, loader->cacheKey(), dataFiles)) {
+        result.data = cache.getData();
+        result.width = cache.getWidth();
+        result.height = cache.getHeight();
+        result.depth = cache.getDepth();
+        result.bitDepth = cache.getBitDepth();
+        result.spacing = cache.getSpacing();
+        result.histogram = cache.getHistogram();
+        result.macrocells = cache.takeMacrocells();
+        result.pyramid = cache.takePyramid();
+        
+        // the values are cached as loaded, the window is what the loader would have chosen
+        if(loader->getLinearize() || Loader::isFloat(result.bitDepth)) {
+            cache.getValueRange(result.windowLow, result.windowHigh);
+        } else {
+            result.windowLow = 0;
+            result.windowHigh = (1u << qMin(16u, result.bitDepth)) - 1;
+        }
+        
+        // a grid of another cell size was left out, bricked voxels can't be searched for it later
+        if(result.macrocells.empty()) {
+            emit loadProgressed(0, 1, "Finding empty space");
+            result.macrocells = Volume::buildMacrocells(result.width, result.height, result.depth, qCeil(result.bitDepth/8.),
+                                                        result.data.data());
         }
-        #endif
+    } else {
+        // from here on the voxels are shared by the volume, the renderer and the cache writer
+        result.data = VolumeBuffer(loader->loadFile(filename), loader->getDeleter());
+        
+        if(result.data.isNull()) {
+            return loaded;
         }
         
-        if(loader != nullptr) {
-            uint8_t *data = loader->loadFile(filename);
+        unsigned bytesPerVal;
+        loader->getDimensions(result.width, result.height, result.depth, bytesPerVal);
+        
+        result.bitDepth = bytesPerVal*8;
+        result.spacing = loader->getSpacing();
+        loader->getValueRange(result.windowLow, result.windowHigh);
+        
+        emit loadProgressed(0, 1, "Finding empty space");
+        result.macrocells = Volume::buildMacrocells(result.width, result.height, result.depth, bytesPerVal, result.data.data());
+        
+        // floats are binned between their smallest and largest value
+        float valueMin, valueMax;
+        Volume::valueRange(result.macrocells, valueMin, valueMax);
+        
+        emit loadProgressed(0, 1, "Calculating histogram");
+        result.histogram = Volume::calculateHistogram(result.width, result.height, result.depth, result.bitDepth, result.data.data(),
+                                                      valueMin, valueMax);
+        
+        // the volume is shown at full resolution first, the pyramid and the cache follow in the background
+        result.pyramidPending = true;
+        
+        if(useCache) {
+            result.cacheSource = filename;
+            result.cacheKey = loader->cacheKey();
+            result.cacheFiles = dataFiles;
+        }
+    }
+    
+    // the volume takes the bricks as they are, so the GUI thread doesn't copy the voxels
+    if(brickSize > 0) {
+        emit loadProgressed(0, 1, "Arranging bricks");
+        result.bricks = Volume::brickVoxels(result.width, result.height, result.depth, qCeil(result.bitDepth/8.),
+                                            result.data.data(), brickSize);
+        result.brickSize = brickSize;
+    }
+    
+    return loaded;
+}
+
+shared_ptr<MainWindow::PyramidResult> MainWindow::buildPyramid(const LoadResult &result, unsigned load)
+{
+    shared_ptr<PyramidResult> levels = make_shared<PyramidResult>();
+    levels->load = load;
+    levels->width = result.width;
+    levels->height = result.height;
+    levels->depth = result.depth;
+    
+    // the renderer uses the coarse levels when zoomed out
+    levels->pyramid = Volume::buildPyramid(result.width, result.height, result.depth, qCeil(result.bitDepth/8.), result.data.data());
+    
+    if(!result.cacheSource.isEmpty()) {
+        VolumeCache::write(result.cacheSource, result.cacheKey, result.cacheFiles,
+                           result.width, result.height, result.depth, result.bitDepth,
+                           result.data.data(), result.histogram, result.spacing, result.macrocells, levels->pyramid);
+    }
+    
+    return levels;
+}
+
+void MainWindow::updateLoadProgress(qint64 done, qint64 total, const QString &stage)
+{
+    if(loadProgress == nullptr) {
+        return;
+    }
+    
+    loadProgress->setLabelText(stage + "...");
+    loadProgress->setValue(total > 0 ? done*1000/total : 0);
+}
+
+void MainWindow::finishLoading()
+{
+    // moved out, the future would keep the voxels until the next load
+    LoadResult result = move(*loadWatcher->result());
+    
+    delete loadProgress;
+    loadProgress = nullptr;
+    
+    if(!result.data.isNull()) {
+        ++loadCount;
+        
+        // the task keeps its own reference to the voxels and a copy of what goes into the cache
+        if(result.pyramidPending) {
+            unsigned load = loadCount;
             
-            unsigned width, height, depth, bystesPerVal;
-            loader->getDimensions(width, height, depth, bystesPerVal);
+            // one cache writer at a time, the same source might be loaded again
+            pyramidWatcher->waitForFinished();
+            pyramidWatcher->setFuture(QtConcurrent::run([this, result, load]() {
+                return buildPyramid(result, load);
+            }));
+        }
+        
+        glw->updateVolume(result.width, result.height, result.depth, result.bitDepth,
+                          result.brickSize > 0 ? result.bricks : result.data, result.histogram,
+                          result.spacing, move(result.pyramid), move(result.macrocells), result.brickSize);
+        vol->setWindow(result.windowLow, result.windowHigh);
+        
+        // a volume from the cache came without slabs, the texture they were meant for isn't needed
+        if(streaming) {
+            glw->cancelVolumeUpload();
+        }
+        
+        // the layout was switched while loading
+        unsigned brickSize = ui->brickedLayout->isChecked() ? 32 : 0;
+        
+        if(brickSize != result.brickSize) {
+            vol->setBrickSize(brickSize);
+        }
+        
+        if(sequence != nullptr) {
+            ui->playSequenceButton->setEnabled(true);
+            ui->sequenceFpsSpinBox->setEnabled(true);
+            updateSequenceFrame(0);
+        }
+    } else {
+        delete sequence;
+        sequence = nullptr;
+        
+        if(streaming) {
+            glw->cancelVolumeUpload();
+        }
+        
+        if(!loader->isCanceled()) {
+            QMessageBox::warning(this, "Loading failed", loader->errorString());
+        }
+    }
+    
+    delete loader;
+    loader = nullptr;
+    
+    ui->loadFileButton->setEnabled(true);
+}
+
+void MainWindow::finishPyramid()
+{
+    shared_ptr<PyramidResult> result = pyramidWatcher->result();
+    
+    // another volume may have been loaded while the levels were built
+    if(result->load != loadCount || result->width != vol->getWidth() || result->height != vol->getHeight()
+            || result->depth != vol->getDepth()) {
+        result->pyramid.clear();
+        return;
+    }
+    
+    vol->setPyramid(move(result->pyramid));
+}
+
+void MainWindow::on_exportFileButton_clicked()
+{
+    if(!vol->hasData()) {
+        return;
+    }
+    
+    if(vol->hasFloatValues()) {
+        QMessageBox::warning(this, "Export failed", "PVM volumes hold 8 or 16 bit values, floats can't be exported");
+        return;
+    }
+    
+    centralWidget()->setDisabled(true);
+    
+    QString filename = QFileDialog::getSaveFileName(this, "Export the volume", "", "PVM volumes (*.pvm)");
+    
+    if(!filename.isEmpty()) {
+        DDSEncoder encoder;
+        
+        const uint8_t *data = vol->getData();
+        vector<uint8_t> linear;
+        
+        // bricked voxels are written slice by slice
+        if(data == nullptr) {
+            size_t sliceBytes = size_t(vol->getWidth())*vol->getHeight()*vol->getBytesPerCell();
+            linear.resize(sliceBytes*vol->getDepth());
             
-            glw->updateVolume(width, height, depth, bystesPerVal*8, data);
+            for(unsigned z=0; z<vol->getDepth(); ++z) {
+                vol->extractSlice(Volume::AXIS_Z, z, &linear[z*sliceBytes]);
+            }
             
-            delete loader;
+            data = linear.data();
+        }
+        
+        // 16 bit volumes are kept in host byte order, PVM wants big endian
+        bool swap = vol->getBytesPerCell() == 2 && QSysInfo::ByteOrder == QSysInfo::LittleEndian;
+        
+        if(!encoder.writePVMvolume(filename.toLocal8Bit().constData(), data,
+                                   vol->getWidth(), vol->getHeight(), vol->getDepth(), vol->getBytesPerCell(),
+                                   1.0f, 1.0f, 1.0f, nullptr, nullptr, nullptr, nullptr, swap)) {
+            QMessageBox::warning(this, "Export failed", encoder.errorString());
         }
     }
     
     centralWidget()->setDisabled(false);
 }
+
+void MainWindow::on_playSequenceButton_toggled(bool play)
+{
+    if(sequence == nullptr) {
+        return;
+    }
+    
+    if(play) {
+        sequence->play();
+    } else {
+        sequence->pause();
+    }
+}
+
+void MainWindow::on_sliceAxis_currentIndexChanged(int axis)
+{
+    const unsigned sizes[] = {vol->getWidth(), vol->getHeight(), vol->getDepth()};
+    
+    ui->sliceSpinBox->setMaximum(sizes[axis]);
+    slw->setAxis(axis);
+}
+
+void MainWindow::on_brickedLayout_toggled(bool bricked)
+{
+    vol->setBrickSize(bricked ? 32 : 0);
+    slw->update();
+}
+
+void MainWindow::updateSequenceFrame(int frame)
+{
+    ui->sequenceFrameLabel->setText(QString("Frame %1/%2").arg(frame+1).arg(sequence->frameCount()));
+}
+
+void MainWindow::updateWindow()
+{
+    double level = ui->windowLevelSpinBox->value(), width = ui->windowWidthSpinBox->value();
+    double low = vol->hasFloatValues() ? level - width/2 : qMax(0, int(level) - int(width)/2);
+    
+    vol->setWindow(low, low + width);
+}
+
+void MainWindow::updateWindowControls()
+{
+    float low = vol->getWindowLow(), high = vol->getWindowHigh();
+    
+    // the spin boxes follow the volume without setting the window again
+    ui->windowLevelSpinBox->blockSignals(true);
+    ui->windowWidthSpinBox->blockSignals(true);
+    
+    ui->windowLevelSpinBox->setValue(vol->hasFloatValues() ? (low + high)/2 : qFloor((low + high)/2));
+    ui->windowWidthSpinBox->setValue(high - low);
+    
+    ui->windowLevelSpinBox->blockSignals(false);
+    ui->windowWidthSpinBox->blockSignals(false);
+}
+
+void MainWindow::sequenceFailed(const QString &error)
+{
+    ui->playSequenceButton->setChecked(false);
+    
+    QMessageBox::warning(this, "Playback failed", error);
+}
@@ -2,11 +2,14 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QFutureWatcher>
 #include <QGLFormat>
 #include <QtWidgets>
 
 #include "Widgets/SliceWidget.h"
 #include "Widgets/VolRenderer.h"
+#include "Formats/Loader.h"
+#include "SequencePlayer.h"
 
 namespace Ui {
 class MainWindow;
@@ -19,6 +22,10 @@ class MainWindow : public QMainWindow
 public:
     explicit MainWindow(QWidget *parent = 0);
     ~MainWindow();
+
+signals:
+    void loadProgressed(qint64 done, qint64 total, const QString &stage);
+    void slabLoaded(unsigned z, unsigned depth, const uint8_t *data);
     
 public slots:
     bool eventFilter(QObject *object, QEvent *e) override;
@@ -34,6 +41,17 @@ private slots:
     void on_saveLutButton_clicked();
     void on_openLutButton_clicked();
     void on_loadFileButton_clicked();
+    void on_exportFileButton_clicked();
+    void on_playSequenceButton_toggled(bool play);
+    void on_sliceAxis_currentIndexChanged(int axis);
+    void on_brickedLayout_toggled(bool bricked);
+    void updateSequenceFrame(int frame);
+    void updateWindow();
+    void updateWindowControls();
+    void sequenceFailed(const QString &error);
+    void updateLoadProgress(qint64 done, qint64 total, const QString &stage);
+    void finishLoading();
+    void finishPyramid();
     void toggleFullscreen();
     
     //void on_pushButton_2_clicked();
@@ -42,6 +60,38 @@ private slots:
     void init();
 
 private:
+    /// What the loading thread hands over to the GUI thread
+    struct LoadResult {
+        VolumeBuffer data;
+        unsigned width = 0, height = 0, depth = 0;
+        unsigned bitDepth = 8;
+        QVector3D spacing = QVector3D(1, 1, 1);
+        float windowLow = 0, windowHigh = 255;
+        
+        QVector<quint64> histogram;
+        Volume::Pyramid pyramid;
+        Volume::Macrocells macrocells;
+        
+        // the pyramid is built after the volume was handed over, and written to the cache along with it if the source is set
+        bool pyramidPending = false;
+        QString cacheSource, cacheKey;
+        QStringList cacheFiles;
+        
+        // data in the layout the volume takes it in, the linear voxels stay in data for the pyramid and the cache
+        VolumeBuffer bricks;
+        unsigned brickSize = 0;
+    };
+    
+    /// The levels built in the background, for the load they were built for
+    struct PyramidResult {
+        unsigned load = 0;
+        unsigned width = 0, height = 0, depth = 0;
+        Volume::Pyramid pyramid;
+    };
+    
+    shared_ptr<LoadResult> load(const QString &filename, bool useCache, unsigned brickSize);
+    shared_ptr<PyramidResult> buildPyramid(const LoadResult &result, unsigned load);
+    
     Ui::MainWindow *ui;
     
     Volume *vol;
@@ -50,6 +100,20 @@ private:
     SliceWidget *slw;
     
     QTimer *fpsTimer;
+    
+    // the load running in the background, if any
+    Loader *loader = nullptr;
+    bool streaming = false;
+    QFutureWatcher<shared_ptr<LoadResult>> *loadWatcher;
+    QProgressDialog *loadProgress = nullptr;
+    
+    // counts the loads that were handed over, a pyramid of an older one is dropped. The levels
+    // are moved out of the shared result, so the future doesn't keep a copy
+    unsigned loadCount = 0;
+    QFutureWatcher<shared_ptr<PyramidResult>> *pyramidWatcher;
+    
+    // plays the frames of a raw sequence, whose first frame is the loaded volume
+    SequencePlayer *sequence = nullptr;
     //QList<double> fps;
     
     QColor showColorChooser(QLineEdit &e);
@@ -9,7 +9,8 @@ OpenWizard::OpenWizard(QWidget *parent) :
 {
     ui->setupUi(this);
     #ifndef USE_DICOM
-    ui->format->takeItem(2);
+    delete ui->format->takeItem(Loader_DicomSeries);
+    delete ui->format->takeItem(Loader_Dicom);
     #endif
 }
 
@@ -48,21 +49,55 @@ bool OpenWizard::getRawNormalize() const
     return ui->rawNormalize->isChecked();
 }
 
+int OpenWizard::getRawIOMode() const
+{
+    return ui->rawIOMode->currentIndex();
+}
+
+void OpenWizard::getRawRegion(unsigned &x, unsigned &y, unsigned &z, unsigned &width, unsigned &height, unsigned &depth) const
+{
+    x = ui->rawRegionX->value();
+    y = ui->rawRegionY->value();
+    z = ui->rawRegionZ->value();
+    
+    width = ui->rawRegionSizeX->value();
+    height = ui->rawRegionSizeY->value();
+    depth = ui->rawRegionSizeZ->value();
+}
+
+void OpenWizard::getRawStride(unsigned &x, unsigned &y, unsigned &z) const
+{
+    x = ui->rawStrideX->value();
+    y = ui->rawStrideY->value();
+    z = ui->rawStrideZ->value();
+}
+
+bool OpenWizard::getUseCache() const
+{
+    return ui->useCache->isChecked();
+}
+
 void OpenWizard::on_OpenWizard_currentIdChanged(int id)
 {
     if(id == 1) {
         format = (Loader)ui->format->currentRow();
         
-        if(format != Loader::Loader_RAW) // 0=RAW
+        // only raw data needs the dimensions
+        if(format != Loader::Loader_RAW && format != Loader::Loader_RawSequence)
         {
             this->accept();
         }
+        
+        // every frame of a sequence is loaded whole
+        ui->regionGroup->setEnabled(format == Loader::Loader_RAW);
     }
 }
 
 void OpenWizard::on_OpenWizard_finished(int result)
 {
-    if(result) {
+    if(result && format == Loader::Loader_DicomSeries) {
+        filename = QFileDialog(this).getExistingDirectory(this, "Select a directory with a Dicom series", "data/scans");
+    } else if(result) {
         filename = QFileDialog(this).getOpenFileName(this, QString("Select a %1 file").arg(ui->format->currentItem()->text()), "data/scans");
     }
 }
@@ -14,8 +14,12 @@ class OpenWizard : public QWizard
 public:
     enum Loader {
         Loader_RAW = 0,
-        Loader_DDS = 1,
-        Loader_Dicom = 2
+        Loader_RawSequence = 1,
+        Loader_DDS = 2,
+        Loader_NRRD = 3,
+        Loader_MetaImage = 4,
+        Loader_Dicom = 5,
+        Loader_DicomSeries = 6
     };
     
     explicit OpenWizard(QWidget *parent = 0);
@@ -27,6 +31,10 @@ public:
     int getRawBitdepth() const;
     int getByteOrder() const;
     bool getRawNormalize() const;
+    int getRawIOMode() const;
+    void getRawRegion(unsigned &x, unsigned &y, unsigned &z, unsigned &width, unsigned &height, unsigned &depth) const;
+    void getRawStride(unsigned &x, unsigned &y, unsigned &z) const;
+    bool getUseCache() const;
     
     
     Loader getFormat() const {return format;}
@@ -4,7 +4,9 @@
 #
 #-------------------------------------------------
 
-QT += core opengl
+QT += core opengl concurrent
+
+LIBS += -lz
 
 TARGET = volume
 TEMPLATE = app
@@ -16,10 +18,18 @@ HEADERS += \
     ui/OpenWizard.h \
     common.h \
     Volume.h \
+    VolumeBuffer.h \
+    VolumeView.h \
     LightSource.h \
+    SequencePlayer.h \
     Formats/Loader.h \
     Formats/DDSLoader.h \
+    Formats/DDSCodec.h \
     Formats/RawLoader.h \
+    Formats/NrrdLoader.h \
+    Formats/MetaImageLoader.h \
+    Formats/NormalizeKernels.h \
+    Formats/VolumeCache.h \
     Widgets/VolRenderer.h
 
 SOURCES += main.cpp \
@@ -30,9 +40,15 @@ SOURCES += main.cpp \
     common.cpp \
     Volume.cpp \
     LightSource.cpp \
+    SequencePlayer.cpp \
     Formats/DDSLoader.cpp \
+    Formats/DDSCodec.cpp \
     Formats/RawLoader.cpp \
+    Formats/NrrdLoader.cpp \
+    Formats/MetaImageLoader.cpp \
     Formats/Loader.cpp \
+    Formats/NormalizeKernels.cpp \
+    Formats/VolumeCache.cpp \
     Widgets/VolRenderer.cpp
 
 FORMS += \
@@ -55,10 +71,12 @@ win32 {
 
 USE_DICOM {
     SOURCES += Formats/DicomLoader.cpp \
+        Formats/DicomSeriesLoader.cpp \
         $$files(lib/base/src/*.cpp) \
         $$files(lib/imebra/src/*.cpp)
 
     HEADERS += Formats/DicomLoader.h \
+        Formats/DicomSeriesLoader.h \
         $$files(lib/base/include/*.h) \
         $$files(lib/imebra/include/*.h)
 }